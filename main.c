@@ -33,13 +33,28 @@
 #include <errno.h>
 #include <fcntl.h>
 #include "ini.h"
+#include <limits.h>
+#include <malloc.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -49,6 +64,42 @@
 #define DEFAULT_TAB_STOP 8
 #define DEFAULT_NL_WIDTH 6
 
+#define SAVE_CHUNK (1 << 16)
+#define OPEN_CHUNK (1 << 26)
+#define RELEASE_ROWS (1 << 16)
+#define PIPE_CHUNK (1 << 20)
+#define DETACH_CHUNK (1 << 20)
+
+#define JOURNAL_MAGIC "CTXTJRNL"
+#define JOURNAL_SYNC_INTERVAL 1000
+#define JOURNAL_BUFFER_MAX (1 << 20)
+#define JOURNAL_RECORD_HEADER 17
+
+#define WATCH_SETTLE 250
+
+#define DIFF_MAX_COST 4096
+#define DIFF_BUDGET 200000000LL
+#define DIFF_CHUNK 65536
+#define DIFF_GUTTER 2
+
+#define HEX_WIDTH 16
+#define HEX_SNIFF (1 << 16)
+
+#define WORD_MIN 2
+#define WORD_MAX 64
+#define WORD_CHUNK 65536
+#define WORD_SEARCH_MAX 4096
+#define WORD_CHOICES 8
+
+#define PARALLEL_MIN_ROWS (1 << 14)
+#define PARALLEL_MAX_THREADS 64
+
+#define INDEX_MAGIC "CTXTLIX2"
+#define INDEX_MIN_SIZE (1 << 24)
+
+#define DAEMON_MAX_ROWS 4096
+#define DAEMON_SEND_TIMEOUT 5
+
 enum Key
 {
 	BACKSPACE = 127,
@@ -58,39 +109,215 @@ enum Key
 	ARROW_UP,
 	ARROW_DOWN,
 	DEL_KEY,
+	PAGE_UP,
+	PAGE_DOWN,
 
 	UNHANDLED_KEY
 };
 
+enum JournalOp
+{
+	JOURNAL_CHECKPOINT = 1,
+	JOURNAL_INSERT_ROW,
+	JOURNAL_DELETE_ROW,
+	JOURNAL_INSERT_CHAR,
+	JOURNAL_DELETE_CHAR,
+	JOURNAL_APPEND_STRING,
+	JOURNAL_TRUNCATE_ROW,
+	JOURNAL_PERMUTE_ROWS,
+	JOURNAL_SELECT_ROWS,
+	JOURNAL_INSERT_ROWS,
+	JOURNAL_BLOCK_INSERT,
+	JOURNAL_BLOCK_DELETE
+};
+
+enum RowFlag
+{
+	ROW_MODIFIED = 1,
+	// chars points into the mapped file and isn't NUL terminated
+	ROW_MAPPED = 2,
+	// chars is NULL, the text is at spill in the spill file
+	ROW_SPILLED = 4
+};
+enum DiffMark
+{
+	DIFF_ADDED = 1,
+	DIFF_CHANGED = 2,
+	// lines of the file were removed just above this row
+	DIFF_REMOVED = 4
+};
+
+// A row that is all zeros is missing: it hasn't been read from the line index or
+// the daemon yet and is filled in by editorRowChars.
+
 typedef struct
 {
 	int size;
 	int rsize;
 	char *chars;
 	char *render;
+	// Location on disk as of the last open or save, -1 if not there
+	off_t offset;
+	off_t spill;
+	int disk_size;
+	int flags;
 } row;
 
+typedef struct
+{
+	char *b;
+	int len;
+} buffer;
+
+#define BUFFER_INIT {NULL, 0}
+
+// Words of the buffer are counted in a trie. Every node knows how many words end
+// there and how many end in its subtree, which bounds the count of any word below
+// it, so the most frequent completions of a prefix are found without visiting all.
+typedef struct
+{
+	int parent;
+	int child;
+	int next;
+	int count;
+	int total;
+	unsigned char c;
+} wordNode;
+
+// Rows start + 1 to end are hidden behind row start. Folds are kept sorted and
+// apart, each knowing how many rows the ones before it hide, so screen lines and
+// rows are mapped onto each other with a binary search.
+typedef struct
+{
+	int start;
+	int end;
+	int hidden_before;
+} fold;
+
+// the journal only applies to the file it was started against
+typedef struct
+{
+	char magic[8];
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} journalHeader;
+
+// The line index of a large file is cached in ~/.cache/ctxt/ so that opening it
+// again doesn't scan it. The header is followed by line_count + 1 offsets, the
+// start of every line ending in '\n' and the end of the last one. The checksum is
+// of the bytes up to there, what the offsets were taken from.
+typedef struct
+{
+	char magic[8];
+	uint64_t path_hash;
+	int64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t line_count;
+	int64_t exact;
+	uint64_t checksum;
+} lineIndexHeader;
+
+// Everything that belongs to one open file. E holds the fields of the buffer being
+// shown, the others keep theirs here so switching back finds them as they were.
+#define BUFFER_FIELDS(X) \
+	/* Cursor Position */ \
+	X(int, cx) X(int, cy) X(int, rx) \
+	/* Rendering Offsets, rowoff counts screen lines and not rows when rows are folded */ \
+	X(int, rowoff) X(int, coloff) \
+	/* File State */ \
+	X(char *, filename) X(int, line_count) X(row *, text) X(int, text_cap) \
+	X(int, dirty) X(off_t, disk_size) X(int, disk_exact) \
+	/* Paging */ \
+	X(char *, map) X(size_t, map_size) X(ino_t, map_ino) X(int, table_fd) X(int, spill_fd) \
+	X(off_t, spill_size) X(int, spilled_rows) X(size_t, heap_bytes) \
+	/* Line Index */ \
+	X(uint64_t *, line_index) X(size_t, index_size) X(int, index_count) \
+	/* Change Detection */ \
+	X(int, watch_wd) X(long long, disk_event) X(int, disk_changed) \
+	/* Diff View */ \
+	X(long long, generation) X(int, diff_view) X(char *, diff_marks) X(int, diff_count) \
+	X(long long, diff_generation) X(int, diff_added) X(int, diff_removed) X(int, diff_changed) \
+	/* Word Index, words_dropped is set when it didn't fit in memlimit */ \
+	X(wordNode *, words) X(int, word_nodes) X(int, word_cap) X(int, word_scanned) X(int, words_dropped) \
+	/* Folded Rows */ \
+	X(fold *, folds) X(int, fold_count) X(int, fold_cap) \
+	/* Hex View, the rows of a binary file are only read once it's shown as text */ \
+	X(int, hex_view) X(int, hex_pending) X(off_t, hex_offset) X(off_t, hex_cursor) \
+	/* Block Cursors, one on every row from block_anchor to cy at screen column block_rx */ \
+	X(int, block_anchor) X(int, block_rx) \
+	/* Recovery Journal */ \
+	X(char *, journal_path) X(int, journal_fd) X(journalHeader, journal_base) \
+	X(buffer, journal_buf) X(int, journal_pending) X(int, journal_unsynced) \
+	X(long long, journal_synced_at) \
+	/* Daemon Connection */ \
+	X(int, remote_fd)
+
+#define BUFFER_FIELD_DECLARE(type, name) type name;
+#define BUFFER_FIELD_STORE(type, name) b->name = E.name;
+#define BUFFER_FIELD_LOAD(type, name) E.name = b->name;
+
+typedef struct
+{
+	BUFFER_FIELDS(BUFFER_FIELD_DECLARE)
+	long long last_used;
+} textBuffer;
+
 struct
 {
-	// Cursor Position
-	int cx, cy;
-	int rx;
-	// Rendering Offsets
-	int rowoff;
-	int coloff;
+	// The Shown Buffer
+	BUFFER_FIELDS(BUFFER_FIELD_DECLARE)
 	// Screen Dimensions
 	int screenrows;
 	int screencols;
-	// File State
-	char *filename;
-	int line_count;
-	row *text;
-	int dirty;
+	// Change Detection
+	int inotify_fd;
+	volatile sig_atomic_t map_damaged;
+	volatile sig_atomic_t map_faults;
+	char *loading_map;
+	size_t loading_size;
+	// Diff View
+	int diff_running;
+	// Word Index
+	int words_running;
+	char *complete_choices[WORD_CHOICES];
+	int complete_count, complete_index;
+	int complete_buffer, complete_row, complete_at, complete_len;
+	long long complete_generation;
+	// Keyboard Macro, keys are read from it instead of the terminal while it's replayed
+	int *macro;
+	int macro_len, macro_cap;
+	int macro_recording;
+	int macro_replaying;
+	int macro_pos;
+	// Recovery Journal
+	int journal_replaying;
+	// Daemon Connection
+	int client;
+	int headless;
+	char remote_in[1 << 16];
+	int remote_in_start, remote_in_end;
+	// Open Buffers
+	textBuffer *buffers;
+	int buffer_count;
+	int current_buffer;
+	long long buffer_clock;
 	// Terminal State
 	struct termios original_termios;
+	int output_fd;
+	// Rendering Thread
+	pthread_t render_thread;
+	pthread_mutex_t lock;
+	pthread_mutex_t output_lock;
+	pthread_cond_t frame_cond;
+	int frame_pending;
 	// Configurables
 	int tab_stop;
 	int number_line;
+	int partial_save;
+	size_t mem_limit;
 	// Statusbar
 	char statusmsg[80];
 	time_t statusmsg_time;
@@ -98,17 +325,43 @@ struct
 	// Text Rendering Dimensions
 	int textcols;
 	int number_line_width;
+	// Last Frame
+	int full_redraw;
+	int damage_lo, damage_hi;
+	int drawn_rowoff, drawn_coloff;
+	int drawn_rows, drawn_cols;
+	int drawn_nl_width;
+	buffer drawn_bars;
 } E;
 
 void die(const char *s)
 {
-	write(STDOUT_FILENO, "\x1b[2J", 4);
-	write(STDOUT_FILENO, "\x1b[H", 3);
+	void editorJournalFlush(int sync);
+
+	pthread_mutex_lock(&E.output_lock);
+	if (!E.headless) {
+		write(STDOUT_FILENO, "\x1b[2J", 4);
+		write(STDOUT_FILENO, "\x1b[H", 3);
+	}
 
 	perror(s);
+	editorJournalFlush(1);
 	exit(1);
 }
 
+void bufferAppend(buffer *buf, const char *s, int len)
+{
+	// realloc to zero bytes may free the buffer
+	if (len == 0) return;
+
+	char *new = realloc(buf->b, buf->len + len);
+
+	if (new == NULL) return;
+	memcpy(&new[buf->len], s, len);
+	buf->b = new;
+	buf->len += len;
+}
+
 void disableRawMode()
 {
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.original_termios) == -1)
@@ -129,6 +382,13 @@ void enableRawMode()
 	raw.c_cc[VTIME] = 1;
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("EnableRawMode: tcsetattr");
+
+	// A slow terminal shouldn't block whoever writes to it, so frames go out through
+	// a non-blocking open of the terminal of their own. Stdout shares its open file
+	// with stdin, which has to keep blocking.
+	char *tty = ttyname(STDOUT_FILENO);
+	E.output_fd = tty ? open(tty, O_WRONLY | O_NONBLOCK | O_CLOEXEC) : -1;
+	if (E.output_fd == -1) E.output_fd = STDOUT_FILENO;
 }
 
 int getCursorPosition(int *rows, int *cols)
@@ -166,431 +426,4729 @@ int getWindowSize(int *rows, int *cols)
 	}
 }
 
-int editorReadKey()
+void editorRequestFrame()
 {
-	int nread;
-	char c;
-	void editorRefreshScreen();
+	E.frame_pending = 1;
+	pthread_cond_signal(&E.frame_cond);
+}
 
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-	{
-		editorRefreshScreen();
-		if (nread == -1 && errno != EAGAIN) die("EditorReadKey: read");
+// The input thread holds the editor lock except while it waits for input here,
+// a frame is only asked for once everything typed ahead has been handled.
+int editorReadByte(char *c, int timeout)
+{
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+	int ready = poll(&pfd, 1, 0);
+	if (ready == 0) {
+		editorRequestFrame();
+		pthread_mutex_unlock(&E.lock);
+		ready = poll(&pfd, 1, timeout);
+		pthread_mutex_lock(&E.lock);
 	}
+	if (ready == -1 && errno != EINTR) die("EditorReadByte: poll");
+	if (ready <= 0) return 0;
+
+	ssize_t nread = read(STDIN_FILENO, c, 1);
+	if (nread == -1 && errno != EAGAIN && errno != EINTR) die("EditorReadByte: read");
+	return nread == 1;
+}
+
+// waits for the rest of a key without letting go of the editor lock
+int editorPollByte(char *c, int timeout)
+{
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	return poll(&pfd, 1, timeout) == 1 && read(STDIN_FILENO, c, 1) == 1;
+}
 
-	if (c == '\x1b') {
-		char seq[3];
+// turns an escape sequence starting with c into the key it stands for
+int editorDecodeKey(char c, int (*read_byte)(char *, int))
+{
+	if (c != '\x1b') return c;
 
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+	char seq[3];
 
-		if (seq[0] == '[') {
-			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-				if (seq[2] == '~') {
-					if (seq[1] == '3') return DEL_KEY;
-				}
-			} else {
+	if (!read_byte(&seq[0], 100)) return '\x1b';
+	if (!read_byte(&seq[1], 100)) return '\x1b';
+
+	if (seq[0] == '[') {
+		if (seq[1] >= '0' && seq[1] <= '9') {
+			if (!read_byte(&seq[2], 100)) return '\x1b';
+			if (seq[2] == '~') {
 				switch (seq[1])
 				{
-					case 'A': return ARROW_UP;
-					case 'B': return ARROW_DOWN;
-					case 'C': return ARROW_RIGHT;
-					case 'D': return ARROW_LEFT;
+					case '3': return DEL_KEY;
+					case '5': return PAGE_UP;
+					case '6': return PAGE_DOWN;
 				}
 			}
+		} else {
+			switch (seq[1])
+			{
+				case 'A': return ARROW_UP;
+				case 'B': return ARROW_DOWN;
+				case 'C': return ARROW_RIGHT;
+				case 'D': return ARROW_LEFT;
+			}
 		}
-		return UNHANDLED_KEY;
-	} else {
-		return c;
 	}
+	return UNHANDLED_KEY;
 }
 
-int editorRowCxToRx(row *row, int cx)
+int editorReadTerminalKey()
 {
-	int rx = 0;
-	int j;
-	for (j = 0; j < cx; j++)
+	char c;
+	void editorForEachBuffer(void (*fn)());
+	void editorJournalSync();
+	void editorEnforceMemoryLimit();
+	void editorWatchEvents();
+	void editorDiffUpdate();
+	void editorWordsUpdate();
+
+	while (!editorReadByte(&c, 100))
 	{
-		if (row->chars[j] == '\t')
-			rx += (E.tab_stop - 1) - (rx % E.tab_stop);
-		rx++;
+		editorWatchEvents();
+		editorDiffUpdate();
+		editorWordsUpdate();
+		editorForEachBuffer(editorJournalSync);
+		editorEnforceMemoryLimit();
 	}
-	return rx;
+	return editorDecodeKey(c, editorReadByte);
 }
 
-void editorUpdateRow(row *line)
+// Whether ESC or Ctrl+C was pressed while something runs that doesn't read keys,
+// other keys typed in the meantime are dropped whole.
+int editorPollCancel()
 {
-	int tabs = 0;
-	int j;
-	for (j = 0; j < line->size; j++)
-		if (line->chars[j] == '\t') tabs++;
-
-	free(line->render);
-	line->render = malloc(line->size + tabs*(E.tab_stop - 1) + 1);
-
-	int idx = 0;
-	for (j = 0; j < line->size; j++)
+	char c;
+	while (editorPollByte(&c, 0))
 	{
-		if (line->chars[j] == '\t') {
-			line->render[idx++] = ' ';
-			while (idx % E.tab_stop != 0) line->render[idx++] = ' ';
-		} else {
-			line->render[idx++] = line->chars[j];
-		}
+		int key = editorDecodeKey(c, editorPollByte);
+		if (key == '\x1b' || key == CTRL_KEY('c')) return 1;
 	}
-	line->render[idx] = '\0';
-	line->rsize = idx;
+	return 0;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+// A macro being replayed stands in for the terminal. When a prompt in it asks for
+// more keys than were recorded, they're typed and the replay stops after that.
+int editorReadKey()
 {
-	if (at < 0 || at > E.line_count) return;
-
-	E.text = realloc(E.text, sizeof(row) * (E.line_count + 1));
-	memmove(&E.text[at + 1], &E.text[at], sizeof(row) * (E.line_count - at));
-
-	E.text[at].size = len;
-	E.text[at].chars = malloc(len + 1);
-	memcpy(E.text[at].chars, s, len);
-	E.text[at].chars[len] = '\0';
+	if (E.macro_replaying) {
+		if (E.macro_pos < E.macro_len) return E.macro[E.macro_pos++];
+		E.macro_replaying = 0;
+	}
 
-	E.text[at].rsize = 0;
-	E.text[at].render = NULL;
-	editorUpdateRow(&E.text[at]);
+	int c = editorReadTerminalKey();
+	if (E.macro_recording) {
+		if (E.macro_len == E.macro_cap) {
+			E.macro_cap = E.macro_cap ? E.macro_cap * 2 : 64;
+			E.macro = realloc(E.macro, sizeof(int) * E.macro_cap);
+			if (E.macro == NULL) die("EditorReadKey: realloc");
+		}
+		E.macro[E.macro_len++] = c;
+	}
+	return c;
+}
 
-	E.line_count++;
-	E.dirty++;
+long long monotonicMillis()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void editorFreeRow(row *line)
+uint32_t journalChecksum(uint32_t sum, const char *s, int len)
 {
-	free(line->render);
-	free(line->chars);
+	int j;
+	for (j = 0; j < len; j++)
+	{
+		sum ^= (unsigned char)s[j];
+		sum *= 16777619u;
+	}
+	return sum;
 }
 
-void editorDelRow(int at)
+char *editorJournalPath(const char *filename)
 {
-  if (at < 0 || at >= E.line_count) return;
-  editorFreeRow(&E.text[at]);
-  memmove(&E.text[at], &E.text[at + 1], sizeof(row) * (E.line_count - at - 1));
-  E.line_count--;
+	const char *base = strrchr(filename, '/');
+	int dirlen = base ? base - filename + 1 : 0;
+	base = base ? base + 1 : filename;
 
-  E.dirty++;
+	size_t len = dirlen + strlen(base) + 16;
+	char *path = malloc(len);
+	snprintf(path, len, "%.*s.%s.ctxt-journal", dirlen, filename, base);
+	return path;
 }
 
-void editorRowInsertChar(row *line, int at, int c)
+void editorJournalSetBase(const char *filename)
 {
-	if (at < 0 || at > line->size) at = line->size;
-	line->chars = realloc(line->chars, line->size + 2);
-	memmove(&line->chars[at + 1], &line->chars[at], line->size - at + 1);
-	line->size++;
-	line->chars[at] = c;
-	editorUpdateRow(line);
+	struct stat st;
 
-	E.dirty++;
+	memset(&E.journal_base, 0, sizeof(E.journal_base));
+	memcpy(E.journal_base.magic, JOURNAL_MAGIC, sizeof(E.journal_base.magic));
+	if (stat(filename, &st) == 0) {
+		E.journal_base.size = st.st_size;
+		E.journal_base.mtime_sec = st.st_mtim.tv_sec;
+		E.journal_base.mtime_nsec = st.st_mtim.tv_nsec;
+	}
 }
 
-void editorRowDelChar(row *line, int at)
+void editorJournalAppend(int op, int a, int b, int c, const char *s, int len)
 {
-	if (at < 0 || at >= line->size) return;
+	void editorJournalFlush(int sync);
+	void editorRemoteSendEdit(const char *head, const char *s, int len, uint32_t sum);
 
-	memmove(&line->chars[at], &line->chars[at + 1], line->size - at);
-	line->size--;
-	editorUpdateRow(line);
+	if (E.journal_replaying) return;
+	if (E.journal_path == NULL && E.remote_fd == -1) return;
 
-	E.dirty++;
+	char head[JOURNAL_RECORD_HEADER];
+	int32_t args[4] = {a, b, c, len};
+	head[0] = op;
+	memcpy(&head[1], args, sizeof(args));
+
+	uint32_t sum = journalChecksum(2166136261u, head, sizeof(head));
+	sum = journalChecksum(sum, s, len);
+
+	if (E.remote_fd != -1) editorRemoteSendEdit(head, s, len, sum);
+	if (E.journal_path == NULL) return;
+
+	bufferAppend(&E.journal_buf, head, sizeof(head));
+	// a large record, like the order of a sort, goes out a piece at a time instead of being copied
+	int done = 0;
+	while (done < len)
+	{
+		int n = len - done < JOURNAL_BUFFER_MAX ? len - done : JOURNAL_BUFFER_MAX;
+		bufferAppend(&E.journal_buf, &s[done], n);
+		done += n;
+		if (E.journal_buf.len >= JOURNAL_BUFFER_MAX) editorJournalFlush(0);
+	}
+	bufferAppend(&E.journal_buf, (char *)&sum, sizeof(sum));
+
+	if (op != JOURNAL_CHECKPOINT) E.journal_pending++;
+	if (E.journal_buf.len >= JOURNAL_BUFFER_MAX) editorJournalFlush(0);
 }
 
-void editorInsertChar(int c)
+void editorJournalFlush(int sync)
 {
-	if (E.cy == E.line_count) {
-		editorInsertRow(E.line_count, "", 0);
+	if (E.journal_path == NULL) return;
+	if (E.journal_buf.len == 0 && !(sync && E.journal_unsynced)) return;
+
+	if (E.journal_fd == -1) {
+		E.journal_fd = open(E.journal_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+		if (E.journal_fd == -1) goto drop;
+		if (write(E.journal_fd, &E.journal_base, sizeof(E.journal_base)) != sizeof(E.journal_base)) {
+			close(E.journal_fd);
+			E.journal_fd = -1;
+			goto drop;
+		}
 	}
-	editorRowInsertChar(&E.text[E.cy], E.cx, c);
-	E.cx++;
+
+	int written = 0;
+	while (written < E.journal_buf.len)
+	{
+		ssize_t n = write(E.journal_fd, &E.journal_buf.b[written], E.journal_buf.len - written);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			goto drop;
+		}
+		written += n;
+	}
+	E.journal_unsynced = 1;
+
+	if (sync) {
+		fdatasync(E.journal_fd);
+		E.journal_unsynced = 0;
+		E.journal_synced_at = monotonicMillis();
+	}
+
+drop:
+	free(E.journal_buf.b);
+	E.journal_buf.b = NULL;
+	E.journal_buf.len = 0;
 }
 
-void editorInsertNewline()
+// called while waiting for input: edits are grouped into one checkpointed fsync
+void editorJournalSync()
 {
-	if (E.cx == 0) {
-		editorInsertRow(E.cy, "", 0);
-	} else {
-		row *line = &E.text[E.cy];
-		editorInsertRow(E.cy + 1, &line->chars[E.cx], line->size - E.cx);
-		line = &E.text[E.cy];
-		line->size = E.cx;
-		line->chars[line->size] = '\0';
-		editorUpdateRow(line);
+	if (E.journal_pending == 0 && !E.journal_unsynced) return;
+	if (monotonicMillis() - E.journal_synced_at < JOURNAL_SYNC_INTERVAL) return;
+
+	if (E.journal_pending) {
+		editorJournalAppend(JOURNAL_CHECKPOINT, E.line_count, E.cy, E.cx, NULL, 0);
+		E.journal_pending = 0;
 	}
-	E.cy++;
-	E.cx = 0;
+	editorJournalFlush(1);
 }
 
-void editorRowAppendString(row *line, char *s, size_t len)
+void editorJournalCompact()
 {
-  line->chars = realloc(line->chars, line->size + len + 1);
-  memcpy(&line->chars[line->size], s, len);
-  line->size += len;
-  line->chars[line->size] = '\0';
-  editorUpdateRow(line);
+	editorJournalSetBase(E.filename);
+	free(E.journal_buf.b);
+	E.journal_buf.b = NULL;
+	E.journal_buf.len = 0;
+	E.journal_pending = 0;
+	E.journal_unsynced = 0;
 
-  E.dirty++;
+	if (E.journal_fd == -1) return;
+	if (ftruncate(E.journal_fd, 0) == -1 ||
+		write(E.journal_fd, &E.journal_base, sizeof(E.journal_base)) != sizeof(E.journal_base)) {
+		close(E.journal_fd);
+		E.journal_fd = -1;
+		unlink(E.journal_path);
+		return;
+	}
+	fdatasync(E.journal_fd);
 }
 
-void editorDelChar()
+void editorJournalRemove()
 {
-	if (E.cy == E.line_count) return;
-	if (E.cx == 0 && E.cy == 0) return;
+	if (E.journal_path == NULL) return;
 
-	row *line = &E.text[E.cy];
-	if (E.cx > 0) {
-		editorRowDelChar(line, E.cx - 1);
-		E.cx--;
-	} else {
-		E.cx = E.text[E.cy - 1].size;
-		editorRowAppendString(&E.text[E.cy - 1], line->chars, line->size);
-		editorDelRow(E.cy);
-		E.cy--;
+	if (E.journal_fd != -1) close(E.journal_fd);
+	E.journal_fd = -1;
+	unlink(E.journal_path);
+
+	free(E.journal_buf.b);
+	E.journal_buf.b = NULL;
+	E.journal_buf.len = 0;
+	E.journal_pending = 0;
+	E.journal_unsynced = 0;
+}
+
+int pwriteAll(int fd, const char *b, size_t len, off_t at)
+{
+	while (len > 0)
+	{
+		ssize_t n = pwrite(fd, b, len, at);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		b += n;
+		at += n;
+		len -= n;
 	}
+	return 0;
 }
 
-char *editorRowsToString(int *buflen)
+int editorTempFile()
 {
-	int total_len = 0;
-	int j;
+	char path[4096];
+	const char *dir = getenv("TMPDIR");
 
-	for (j = 0; j < E.line_count; j++)
-		total_len += E.text[j].size + 1;
+	// /tmp is often tmpfs, which would keep the spilled text in memory anyway
+	snprintf(path, sizeof(path), "%s/ctxt-XXXXXX", dir ? dir : "/var/tmp");
+	int fd = mkostemp(path, O_CLOEXEC);
+	if (fd != -1) unlink(path);
+	return fd;
+}
 
-	*buflen = total_len;
-	char *buf = malloc(total_len);
-	char *p = buf;
+void editorDropPages(void *addr, size_t len)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t)addr + len) & ~(page - 1);
 
-	for (j = 0; j < E.line_count; j++) {
-		memcpy(p, E.text[j].chars, E.text[j].size);
-		p += E.text[j].size;
-		*p = '\n';
-		p++;
-	}
-	return buf;
+	if (end > start) madvise((void *)start, end - start, MADV_DONTNEED);
 }
 
-void editorOpen(char *filename)
+// Scratch arrays of long operations go in an unlinked file when memlimit is set, so
+// their pages can be given back as they are passed like the row table's.
+void *editorScratchAlloc(size_t size)
 {
-	free(E.filename);
-	E.filename = strdup(filename);
+	if (E.mem_limit == 0) return malloc(size);
 
-	FILE *fp = fopen(filename, "r");
-	if (!fp) die("EditorOpen: fopen");
+	int fd = editorTempFile();
+	if (fd == -1) return NULL;
+	void *p = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	return p == MAP_FAILED ? NULL : p;
+}
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1)
-	{
-		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-			linelen--;
-		editorInsertRow(E.line_count, line, linelen);
-	}
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
+void editorScratchFree(void *p, size_t size)
+{
+	if (E.mem_limit == 0) free(p);
+	else if (p) munmap(p, size);
 }
 
-void editorSave()
+void editorScratchDrop(void *p, size_t size)
 {
-	void editorSetStatusMessage(int duration, const char *fmt, ...);
+	if (E.mem_limit) editorDropPages(p, size);
+}
 
-	if (E.filename == NULL) E.filename = "file.txt";
+// long walks over a file backed row table give back the rows they have passed
+void editorReleaseRows(int at)
+{
+	if (E.table_fd == -1 || at == 0 || at % RELEASE_ROWS != 0) return;
+	editorDropPages(&E.text[at - RELEASE_ROWS], sizeof(row) * RELEASE_ROWS);
+}
 
-	int len;
-	char *buf = editorRowsToString(&len);
+void editorReserveRows(int count)
+{
+	if (count <= E.text_cap) return;
 
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len) == len) {
-				close(fd);
-				free(buf);
-				E.dirty = 0;
-				editorSetStatusMessage(5, "%d bytes written to disk", len);
-				return;
-			}
-		}
-		close(fd);
+	int cap = E.text_cap ? E.text_cap : 64;
+	while (cap < count) cap *= 2;
+
+	if (E.table_fd != -1) {
+		size_t old = sizeof(row) * E.text_cap;
+		size_t new = sizeof(row) * cap;
+		if (ftruncate(E.table_fd, new) == -1) die("EditorReserveRows: ftruncate");
+
+		void *text = E.text
+			? mremap(E.text, old, new, MREMAP_MAYMOVE)
+			: mmap(NULL, new, PROT_READ | PROT_WRITE, MAP_SHARED, E.table_fd, 0);
+		if (text == MAP_FAILED) die("EditorReserveRows: mmap");
+		E.text = text;
+	} else {
+		E.text = realloc(E.text, sizeof(row) * cap);
+		if (E.text == NULL) die("EditorReserveRows: realloc");
 	}
+	E.text_cap = cap;
+}
 
-	free(buf);
-	editorSetStatusMessage(5, "can't write to disk! I/O error: %s", strerror(errno));
+int editorRowMissing(row *line)
+{
+	return line->chars == NULL && !(line->flags & ROW_SPILLED);
 }
 
-typedef struct
+char *editorRowChars(row *line)
 {
-	char *b;
-	int len;
-} buffer;
+	void editorFillRows(int first, int count);
 
-#define BUFFER_INIT {NULL, 0}
+	if (editorRowMissing(line)) editorFillRows(line - E.text, 1);
 
-void bufferAppend(buffer *buf, const char *s, int len)
+	if (line->flags & ROW_SPILLED) {
+		char *chars = malloc(line->size + 1);
+		if (chars == NULL || pread(E.spill_fd, chars, line->size, line->spill) != line->size)
+			die("EditorRowChars: pread");
+		chars[line->size] = '\0';
+
+		line->chars = chars;
+		line->flags &= ~ROW_SPILLED;
+		E.heap_bytes += line->size + 1;
+
+		if (--E.spilled_rows == 0 && ftruncate(E.spill_fd, 0) == 0)
+			E.spill_size = 0;
+	}
+	return line->chars;
+}
+
+// appends the text of a row, a spilled row is read without being brought back
+void editorRowCopy(row *line, buffer *buf)
 {
-	char *new = realloc(buf->b, buf->len + len);
+	if (!(line->flags & ROW_SPILLED) || line->size == 0) {
+		// a row missing from the index only gets its size once filled in
+		char *chars = editorRowChars(line);
+		bufferAppend(buf, chars, line->size);
+		return;
+	}
 
-	if (new == NULL) return;
-	memcpy(&new[buf->len], s, len);
+	char *new = realloc(buf->b, buf->len + line->size);
+	if (new == NULL) die("EditorRowCopy: realloc");
 	buf->b = new;
-	buf->len += len;
+	if (pread(E.spill_fd, &buf->b[buf->len], line->size, line->spill) != line->size)
+		die("EditorRowCopy: pread");
+	buf->len += line->size;
 }
 
-void editorScroll()
+// gives the row its own copy of the text before it is changed
+char *editorRowWritable(row *line)
 {
-	E.rx = 0;
-	if (E.cy < E.line_count) {
-		E.rx = editorRowCxToRx(&E.text[E.cy], E.cx);
-	}
+	editorRowChars(line);
+	if (line->flags & ROW_MAPPED) {
+		char *chars = malloc(line->size + 1);
+		if (chars == NULL) die("EditorRowWritable: malloc");
+		memcpy(chars, line->chars, line->size);
+		chars[line->size] = '\0';
 
-	if (E.cy < E.rowoff) {
-		E.rowoff = E.cy;
-	}
-	if (E.cy >= E.rowoff + E.screenrows) {
-		E.rowoff = E.cy - E.screenrows + 1;
+		line->chars = chars;
+		line->flags &= ~ROW_MAPPED;
+		E.heap_bytes += line->size + 1;
 	}
-	if (E.rx < E.coloff) {
-		E.coloff = E.rx;
-	}
-	if (E.rx >= E.coloff + E.textcols) {
+	line->flags |= ROW_MODIFIED;
+	return line->chars;
+}
+
+void editorRowDropRender(row *line)
+{
+	if (line->render == NULL) return;
+
+	E.heap_bytes -= line->rsize + 1;
+	free(line->render);
+	line->render = NULL;
+	line->rsize = 0;
+}
+
+int editorRowSpill(row *line)
+{
+	if (line->flags & (ROW_MAPPED | ROW_SPILLED) || line->chars == NULL) return 0;
+
+	// the daemon has every row of an attached buffer, it is fetched again
+	if (E.remote_fd != -1) {
+		E.heap_bytes -= line->size + 1;
+		free(line->chars);
+		line->chars = NULL;
+		return 0;
+	}
+
+	if (E.spill_fd == -1 && (E.spill_fd = editorTempFile()) == -1) return -1;
+	if (pwriteAll(E.spill_fd, line->chars, line->size, E.spill_size) == -1) return -1;
+
+	free(line->chars);
+	line->chars = NULL;
+	line->spill = E.spill_size;
+	line->flags |= ROW_SPILLED;
+
+	E.spill_size += line->size;
+	E.spilled_rows++;
+	E.heap_bytes -= line->size + 1;
+	return 0;
+}
+
+size_t editorResidentBytes()
+{
+	long size, resident = 0;
+
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL) return 0;
+	if (fscanf(fp, "%ld %ld", &size, &resident) != 2) resident = 0;
+	fclose(fp);
+
+	return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+void editorStoreBuffer(textBuffer *b)
+{
+	BUFFER_FIELDS(BUFFER_FIELD_STORE)
+}
+
+void editorLoadBuffer(textBuffer *b)
+{
+	BUFFER_FIELDS(BUFFER_FIELD_LOAD)
+}
+
+void editorSwapBuffer(int index)
+{
+	editorStoreBuffer(&E.buffers[E.current_buffer]);
+	E.current_buffer = index;
+	editorLoadBuffer(&E.buffers[index]);
+}
+
+// runs fn with every buffer in turn loaded into E
+void editorForEachBuffer(void (*fn)())
+{
+	int current = E.current_buffer;
+	int j;
+	for (j = 0; j < E.buffer_count; j++)
+	{
+		editorSwapBuffer(j);
+		fn();
+	}
+	editorSwapBuffer(current);
+}
+
+void editorResetBuffer()
+{
+	E.cx = 0;
+	E.cy = 0;
+	E.rx = 0;
+
+	E.rowoff = 0;
+	E.coloff = 0;
+
+	E.line_count = 0;
+	E.text = NULL;
+	E.text_cap = 0;
+	E.filename = NULL;
+	E.dirty = 0;
+	E.disk_size = 0;
+	E.disk_exact = 0;
+
+	E.map = NULL;
+	E.map_size = 0;
+	E.map_ino = 0;
+	E.table_fd = -1;
+	E.spill_fd = -1;
+	E.spill_size = 0;
+	E.spilled_rows = 0;
+	E.heap_bytes = 0;
+
+	E.journal_path = NULL;
+	E.journal_fd = -1;
+	E.journal_buf.b = NULL;
+	E.journal_buf.len = 0;
+	E.journal_pending = 0;
+	E.journal_unsynced = 0;
+	E.journal_synced_at = 0;
+
+	E.remote_fd = -1;
+
+	E.line_index = NULL;
+	E.index_size = 0;
+	E.index_count = 0;
+
+	E.watch_wd = -1;
+	E.disk_event = 0;
+	E.disk_changed = 0;
+
+	E.generation = 0;
+	E.diff_view = 0;
+	E.diff_marks = NULL;
+	E.diff_count = 0;
+	E.diff_generation = -1;
+	E.diff_added = 0;
+	E.diff_removed = 0;
+	E.diff_changed = 0;
+
+	E.words = NULL;
+	E.word_nodes = 0;
+	E.word_cap = 0;
+	E.word_scanned = 0;
+	E.words_dropped = 0;
+
+	E.folds = NULL;
+	E.fold_count = 0;
+	E.fold_cap = 0;
+
+	E.hex_view = 0;
+	E.hex_pending = 0;
+	E.hex_offset = 0;
+	E.hex_cursor = 0;
+
+	E.block_anchor = -1;
+	E.block_rx = 0;
+
+	if (E.mem_limit && (E.table_fd = editorTempFile()) == -1) die("EditorResetBuffer: editorTempFile");
+}
+
+size_t editorHeapBytes()
+{
+	size_t total = E.heap_bytes;
+	int j;
+	for (j = 0; j < E.buffer_count; j++)
+		if (j != E.current_buffer) total += E.buffers[j].heap_bytes;
+	return total;
+}
+
+// render caches and modified rows off screen go until the buffer is down to target
+void editorTrimRows(size_t target)
+{
+	int editorFileRow(int visible);
+
+	int first = editorFileRow(E.rowoff);
+	int last = editorFileRow(E.rowoff + E.screenrows);
+	int j;
+	for (j = 0; j < E.line_count && E.heap_bytes > target; j++)
+	{
+		editorReleaseRows(j);
+		if (j >= first && j < last) continue;
+		editorRowDropRender(&E.text[j]);
+		editorRowSpill(&E.text[j]);
+	}
+}
+
+void editorDropBufferPages()
+{
+	if (E.map) editorDropPages(E.map, E.map_size);
+	if (E.table_fd != -1) editorDropPages(E.text, sizeof(row) * E.text_cap);
+	if (E.line_index) editorDropPages((char *)E.line_index - sizeof(lineIndexHeader), E.index_size);
+}
+
+// Buffers may use half of the limit between them. Beyond that the buffers not
+// being shown give up their render caches, modified rows and word indexes, least
+// recently used first, then the current one does for the rows off screen. Mapped
+// text is dropped back to the page cache whenever the resident set gets over the
+// limit, it is read in again on demand.
+void editorEnforceMemoryLimit()
+{
+	void editorWordsRewind(int at);
+	void editorWordsCheckLimit();
+
+	if (E.mem_limit == 0) return;
+
+	editorWordsCheckLimit();
+	if (editorHeapBytes() > E.mem_limit / 2) {
+		int current = E.current_buffer;
+		int trimmed;
+		for (trimmed = 0; trimmed < E.buffer_count - 1 && editorHeapBytes() > E.mem_limit / 4; trimmed++)
+		{
+			int victim = -1;
+			int j;
+			for (j = 0; j < E.buffer_count; j++)
+			{
+				if (j == current || E.buffers[j].heap_bytes == 0) continue;
+				if (victim == -1 || E.buffers[j].last_used < E.buffers[victim].last_used) victim = j;
+			}
+			if (victim == -1) break;
+
+			editorSwapBuffer(victim);
+			editorTrimRows(0);
+			editorWordsRewind(0);
+			E.buffers[victim].last_used = -1;
+			editorSwapBuffer(current);
+		}
+
+		size_t others = editorHeapBytes() - E.heap_bytes;
+		editorTrimRows(others < E.mem_limit / 4 ? E.mem_limit / 4 - others : 0);
+		malloc_trim(0);
+	}
+
+	if (editorResidentBytes() > E.mem_limit)
+		editorForEachBuffer(editorDropBufferPages);
+}
+
+int editorRowCxToRx(row *row, int cx)
+{
+	char *chars = editorRowChars(row);
+	int rx = 0;
+	int j;
+	for (j = 0; j < cx; j++)
+	{
+		if (chars[j] == '\t')
+			rx += (E.tab_stop - 1) - (rx % E.tab_stop);
+		rx++;
+	}
+	return rx;
+}
+
+// the index of the character starting at column rx, -1 if the row ends before
+// it or a tab covers it
+int editorRowRxToCx(row *line, int rx)
+{
+	char *chars = editorRowChars(line);
+	int cur = 0;
+	int cx;
+	for (cx = 0; cx < line->size && cur < rx; cx++)
+	{
+		if (chars[cx] == '\t')
+			cur += (E.tab_stop - 1) - (cur % E.tab_stop);
+		cur++;
+	}
+	return cur == rx ? cx : -1;
+}
+
+void editorUpdateRow(row *line)
+{
+	char *chars = editorRowChars(line);
+	int tabs = 0;
+	int j;
+	for (j = 0; j < line->size; j++)
+		if (chars[j] == '\t') tabs++;
+
+	editorRowDropRender(line);
+	line->render = malloc(line->size + tabs*(E.tab_stop - 1) + 1);
+
+	int idx = 0;
+	for (j = 0; j < line->size; j++)
+	{
+		if (chars[j] == '\t') {
+			line->render[idx++] = ' ';
+			while (idx % E.tab_stop != 0) line->render[idx++] = ' ';
+		} else {
+			line->render[idx++] = chars[j];
+		}
+	}
+	line->render[idx] = '\0';
+	line->rsize = idx;
+	E.heap_bytes += line->rsize + 1;
+}
+
+// every change to the text comes through here, it also moves the buffer to a new generation
+void editorDamageRows(int from, int to)
+{
+	E.generation++;
+	if (from < E.damage_lo) E.damage_lo = from;
+	if (to > E.damage_hi) E.damage_hi = to;
+}
+
+// render caches are only built for rows that get drawn
+char *editorRowRender(row *line)
+{
+	if (line->render == NULL) editorUpdateRow(line);
+	return line->render;
+}
+
+int isWordChar(unsigned char c)
+{
+	return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+int editorWordChild(int node, unsigned char c, int create)
+{
+	int child;
+	for (child = E.words[node].child; child != -1; child = E.words[child].next)
+		if (E.words[child].c == c) return child;
+	if (!create) return -1;
+
+	if (E.word_nodes == E.word_cap) {
+		E.heap_bytes += sizeof(wordNode) * E.word_cap;
+		E.word_cap = E.word_cap ? E.word_cap * 2 : 1024;
+		E.words = realloc(E.words, sizeof(wordNode) * E.word_cap);
+		if (E.words == NULL) die("EditorWordChild: realloc");
+	}
+	child = E.word_nodes++;
+	E.words[child].parent = node;
+	E.words[child].child = -1;
+	E.words[child].next = E.words[node].child;
+	E.words[child].count = 0;
+	E.words[child].total = 0;
+	E.words[child].c = c;
+	E.words[node].child = child;
+	return child;
+}
+
+// numbers and very short or long words are left out, nobody completes those
+void editorWordCount(const char *s, int len, int delta)
+{
+	if (len < WORD_MIN || len > WORD_MAX || isdigit((unsigned char)s[0])) return;
+
+	if (E.words == NULL) {
+		E.word_cap = 1024;
+		E.words = malloc(sizeof(wordNode) * E.word_cap);
+		if (E.words == NULL) die("EditorWordCount: malloc");
+		E.heap_bytes += sizeof(wordNode) * E.word_cap;
+		memset(&E.words[0], 0, sizeof(wordNode));
+		E.words[0].parent = E.words[0].child = E.words[0].next = -1;
+		E.word_nodes = 1;
+	}
+
+	int node = 0;
+	int j;
+	if (delta < 0) {
+		for (j = 0; j < len && node != -1; j++)
+			node = editorWordChild(node, s[j], 0);
+		if (node == -1 || E.words[node].count < -delta) return;
+	}
+
+	node = 0;
+	E.words[0].total += delta;
+	for (j = 0; j < len; j++)
+	{
+		node = editorWordChild(node, s[j], 1);
+		E.words[node].total += delta;
+	}
+	E.words[node].count += delta;
+}
+
+// counts the words touching from..to, the span is widened to whole words
+void editorWordsInSpan(row *line, int from, int to, int delta)
+{
+	// spilled rows are read without being loaded back
+	buffer copy = BUFFER_INIT;
+	char *chars;
+	if (line->flags & ROW_SPILLED) {
+		editorRowCopy(line, &copy);
+		chars = copy.b;
+	} else {
+		chars = editorRowChars(line);
+	}
+
+	while (from > 0 && isWordChar(chars[from - 1])) from--;
+	while (to < line->size && isWordChar(chars[to])) to++;
+
+	int j = from;
+	while (j < to)
+	{
+		while (j < to && !isWordChar(chars[j])) j++;
+		int start = j;
+		while (j < to && isWordChar(chars[j])) j++;
+		if (j > start) editorWordCount(&chars[start], j - start, delta);
+	}
+	free(copy.b);
+}
+
+// rows above word_scanned are counted, the others wait for the builder
+int editorWordsCounted(row *line)
+{
+	return line - E.text < E.word_scanned;
+}
+
+// takes the rows from at on out of the index, the builder counts them again
+void editorWordsRewind(int at)
+{
+	if (at >= E.word_scanned) return;
+
+	if (at == 0) {
+		E.heap_bytes -= sizeof(wordNode) * E.word_cap;
+		free(E.words);
+		E.words = NULL;
+		E.word_nodes = 0;
+		E.word_cap = 0;
+	} else {
+		int j;
+		for (j = at; j < E.word_scanned; j++)
+			editorWordsInSpan(&E.text[j], 0, E.text[j].size, -1);
+	}
+	E.word_scanned = at;
+}
+
+// An index that takes more than half of memlimit is dropped, rows can be spilled
+// but the index can't. Ctrl+T says so rather than building it again.
+void editorWordsCheckLimit()
+{
+	if (E.mem_limit == 0 || sizeof(wordNode) * E.word_cap <= E.mem_limit / 2) return;
+
+	editorWordsRewind(0);
+	E.words_dropped = 1;
+}
+
+void editorFoldsChanged()
+{
+	int hidden = 0;
+	int j;
+	for (j = 0; j < E.fold_count; j++)
+	{
+		E.folds[j].hidden_before = hidden;
+		hidden += E.folds[j].end - E.folds[j].start;
+	}
+	E.full_redraw = 1;
+}
+
+// the last fold starting at or before the row, -1 if there is none
+int editorFoldBefore(int filerow)
+{
+	int lo = 0, hi = E.fold_count - 1, found = -1;
+	while (lo <= hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (E.folds[mid].start <= filerow) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+// the screen line a row is on, counted from the top of the buffer
+int editorVisibleRow(int filerow)
+{
+	int f = editorFoldBefore(filerow);
+	if (f == -1) return filerow;
+	if (filerow <= E.folds[f].end) return E.folds[f].start - E.folds[f].hidden_before;
+	return filerow - E.folds[f].hidden_before - (E.folds[f].end - E.folds[f].start);
+}
+
+// the row shown on a screen line
+int editorFileRow(int visible)
+{
+	int lo = 0, hi = E.fold_count - 1, f = -1;
+	while (lo <= hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if (E.folds[mid].start - E.folds[mid].hidden_before <= visible) {
+			f = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (f == -1) return visible;
+	if (visible == E.folds[f].start - E.folds[f].hidden_before) return E.folds[f].start;
+	return visible + E.folds[f].hidden_before + (E.folds[f].end - E.folds[f].start);
+}
+
+void editorAddFold(int start, int end)
+{
+	if (end <= start) return;
+
+	int at = editorFoldBefore(start) + 1;
+	if (at > 0 && E.folds[at - 1].end >= start) return;
+	if (at < E.fold_count && E.folds[at].start <= end) return;
+
+	if (E.fold_count == E.fold_cap) {
+		E.fold_cap = E.fold_cap ? E.fold_cap * 2 : 16;
+		E.folds = realloc(E.folds, sizeof(fold) * E.fold_cap);
+		if (E.folds == NULL) die("EditorAddFold: realloc");
+	}
+	memmove(&E.folds[at + 1], &E.folds[at], sizeof(fold) * (E.fold_count - at));
+	E.folds[at].start = start;
+	E.folds[at].end = end;
+	E.fold_count++;
+	editorFoldsChanged();
+}
+
+void editorRemoveFold(int index)
+{
+	memmove(&E.folds[index], &E.folds[index + 1], sizeof(fold) * (E.fold_count - index - 1));
+	E.fold_count--;
+	editorFoldsChanged();
+}
+
+// rows inserted inside a fold stay hidden with it, the ones before it move it down
+void editorFoldsInsert(int at, int count)
+{
+	if (E.fold_count == 0) return;
+
+	int j;
+	for (j = 0; j < E.fold_count; j++)
+	{
+		if (E.folds[j].start >= at) E.folds[j].start += count;
+		if (E.folds[j].end >= at) E.folds[j].end += count;
+	}
+	editorFoldsChanged();
+}
+
+// a fold losing its first row starts at the next one, one left with a single row is gone
+void editorFoldsDelete(int at, int count)
+{
+	if (E.fold_count == 0) return;
+
+	int kept = 0;
+	int j;
+	for (j = 0; j < E.fold_count; j++)
+	{
+		fold f = E.folds[j];
+		if (f.start >= at + count) f.start -= count;
+		else if (f.start > at) f.start = at;
+		if (f.end >= at + count) f.end -= count;
+		else if (f.end >= at) f.end = at - 1;
+		if (f.end > f.start) E.folds[kept++] = f;
+	}
+	E.fold_count = kept;
+	editorFoldsChanged();
+}
+
+// folds overlapping rows that were reordered don't hold anything sensible anymore
+void editorFoldsClear(int at, int count)
+{
+	int kept = 0;
+	int j;
+	for (j = 0; j < E.fold_count; j++)
+		if (E.folds[j].end < at || E.folds[j].start >= at + count) E.folds[kept++] = E.folds[j];
+	if (kept == E.fold_count) return;
+	E.fold_count = kept;
+	editorFoldsChanged();
+}
+
+void editorInsertRow(int at, const char *s, size_t len)
+{
+	void editorIndexRelease();
+
+	if (at < 0 || at > E.line_count) return;
+	editorIndexRelease();
+	editorJournalAppend(JOURNAL_INSERT_ROW, at, 0, 0, s, len);
+	int counted = at < E.word_scanned;
+
+	editorReserveRows(E.line_count + 1);
+	memmove(&E.text[at + 1], &E.text[at], sizeof(row) * (E.line_count - at));
+
+	E.text[at].size = len;
+	E.text[at].chars = malloc(len + 1);
+	memcpy(E.text[at].chars, s, len);
+	E.text[at].chars[len] = '\0';
+	E.heap_bytes += len + 1;
+
+	E.text[at].rsize = 0;
+	E.text[at].render = NULL;
+	E.text[at].offset = -1;
+	E.text[at].disk_size = 0;
+	E.text[at].spill = -1;
+	E.text[at].flags = ROW_MODIFIED;
+
+	E.line_count++;
+	if (counted) {
+		E.word_scanned++;
+		editorWordsInSpan(&E.text[at], 0, len, 1);
+	}
+	editorFoldsInsert(at, 1);
+	editorDamageRows(at, INT_MAX);
+	E.dirty++;
+}
+
+// inserts the lines of s at once, a newline at the end doesn't start another row
+void editorInsertRows(int at, const char *s, size_t len)
+{
+	void editorIndexRelease();
+
+	if (at < 0 || at > E.line_count || len == 0) return;
+	editorIndexRelease();
+	editorJournalAppend(JOURNAL_INSERT_ROWS, at, 0, 0, s, len);
+	int counted = at < E.word_scanned;
+
+	int count = 0;
+	const char *p = s, *end = s + len, *nl;
+	while (p < end)
+	{
+		nl = memchr(p, '\n', end - p);
+		count++;
+		p = nl ? nl + 1 : end;
+	}
+
+	editorReserveRows(E.line_count + count);
+	memmove(&E.text[at + count], &E.text[at], sizeof(row) * (E.line_count - at));
+
+	row *line = &E.text[at];
+	for (p = s; p < end; line++)
+	{
+		nl = memchr(p, '\n', end - p);
+		size_t size = nl ? (size_t)(nl - p) : (size_t)(end - p);
+
+		line->size = size;
+		line->chars = malloc(size + 1);
+		if (line->chars == NULL) die("EditorInsertRows: malloc");
+		memcpy(line->chars, p, size);
+		line->chars[size] = '\0';
+		E.heap_bytes += size + 1;
+
+		line->rsize = 0;
+		line->render = NULL;
+		line->offset = -1;
+		line->disk_size = 0;
+		line->spill = -1;
+		line->flags = ROW_MODIFIED;
+		p += size + 1;
+		if (counted) editorWordsInSpan(line, 0, size, 1);
+	}
+
+	E.line_count += count;
+	if (counted) E.word_scanned += count;
+	editorFoldsInsert(at, count);
+	editorDamageRows(at, INT_MAX);
+	E.dirty++;
+}
+
+void editorFreeRow(row *line)
+{
+	editorRowDropRender(line);
+	if (!(line->flags & (ROW_MAPPED | ROW_SPILLED)) && line->chars) {
+		E.heap_bytes -= line->size + 1;
+		free(line->chars);
+	}
+	if (line->flags & ROW_SPILLED) E.spilled_rows--;
+}
+
+void editorDelRow(int at)
+{
+  void editorIndexRelease();
+
+  if (at < 0 || at >= E.line_count) return;
+  editorIndexRelease();
+  editorJournalAppend(JOURNAL_DELETE_ROW, at, 0, 0, NULL, 0);
+  if (at < E.word_scanned) {
+    editorWordsInSpan(&E.text[at], 0, E.text[at].size, -1);
+    E.word_scanned--;
+  }
+  editorFreeRow(&E.text[at]);
+  memmove(&E.text[at], &E.text[at + 1], sizeof(row) * (E.line_count - at - 1));
+  E.line_count--;
+  editorFoldsDelete(at, 1);
+  editorDamageRows(at, INT_MAX);
+
+  E.dirty++;
+}
+
+void editorRowInsertChar(row *line, int at, int c)
+{
+	if (at < 0 || at > line->size) at = line->size;
+	editorJournalAppend(JOURNAL_INSERT_CHAR, line - E.text, at, c, NULL, 0);
+	int counted = editorWordsCounted(line);
+	if (counted) editorWordsInSpan(line, at, at, -1);
+	editorRowWritable(line);
+	line->chars = realloc(line->chars, line->size + 2);
+	memmove(&line->chars[at + 1], &line->chars[at], line->size - at + 1);
+	line->size++;
+	line->chars[at] = c;
+	E.heap_bytes++;
+	if (counted) editorWordsInSpan(line, at, at + 1, 1);
+	editorRowDropRender(line);
+	editorDamageRows(line - E.text, line - E.text);
+
+	E.dirty++;
+}
+
+void editorRowDelChar(row *line, int at)
+{
+	if (at < 0 || at >= line->size) return;
+	editorJournalAppend(JOURNAL_DELETE_CHAR, line - E.text, at, 0, NULL, 0);
+	int counted = editorWordsCounted(line);
+	if (counted) editorWordsInSpan(line, at, at + 1, -1);
+	editorRowWritable(line);
+
+	memmove(&line->chars[at], &line->chars[at + 1], line->size - at);
+	line->size--;
+	E.heap_bytes--;
+	if (counted) editorWordsInSpan(line, at, at, 1);
+	editorRowDropRender(line);
+	editorDamageRows(line - E.text, line - E.text);
+
+	E.dirty++;
+}
+
+void editorRowTruncate(row *line, int size)
+{
+	if (size < 0 || size >= line->size) return;
+	editorJournalAppend(JOURNAL_TRUNCATE_ROW, line - E.text, size, 0, NULL, 0);
+	int counted = editorWordsCounted(line);
+	if (counted) editorWordsInSpan(line, size, line->size, -1);
+	editorRowWritable(line);
+
+	E.heap_bytes -= line->size - size;
+	line->size = size;
+	line->chars[line->size] = '\0';
+	if (counted) editorWordsInSpan(line, size, size, 1);
+	editorRowDropRender(line);
+	editorDamageRows(line - E.text, line - E.text);
+
+	E.dirty++;
+}
+
+// Reorders the rows at..at+count so that row at+j is the one that was at
+// at+order[j]. Only the row structs move, the text stays where it is.
+void editorPermuteRows(int at, int count, const int32_t *order)
+{
+	void editorIndexRelease();
+
+	if (at < 0 || count <= 0 || at + count > E.line_count) return;
+
+	unsigned char *seen = calloc((count + 7) / 8, 1);
+	int j;
+	for (j = 0; j < count; j++)
+	{
+		if (order[j] < 0 || order[j] >= count || (seen[order[j] >> 3] & (1 << (order[j] & 7)))) break;
+		seen[order[j] >> 3] |= 1 << (order[j] & 7);
+	}
+	free(seen);
+	if (j < count) return;
+
+	editorIndexRelease();
+	editorJournalAppend(JOURNAL_PERMUTE_ROWS, at, count, 0, (const char *)order, sizeof(int32_t) * count);
+	// rows moving across the end of the counted ones would be counted twice or never
+	if (at + count > E.word_scanned) editorWordsRewind(at);
+	editorFoldsClear(at, count);
+
+	row *moved = editorScratchAlloc(sizeof(row) * count);
+	if (moved == NULL) die("EditorPermuteRows: editorScratchAlloc");
+	for (j = 0; j < count; j += RELEASE_ROWS)
+	{
+		// the rows are gathered from all over the table
+		int n = count - j < RELEASE_ROWS ? count - j : RELEASE_ROWS;
+		int k;
+		for (k = j; k < j + n; k++)
+			moved[k] = E.text[at + order[k]];
+		editorScratchDrop(&moved[j], sizeof(row) * n);
+		if (E.mem_limit && editorResidentBytes() > E.mem_limit) editorDropBufferPages();
+	}
+	for (j = 0; j < count; j += RELEASE_ROWS)
+	{
+		int n = count - j < RELEASE_ROWS ? count - j : RELEASE_ROWS;
+		memcpy(&E.text[at + j], &moved[j], sizeof(row) * n);
+		editorScratchDrop(&moved[j], sizeof(row) * n);
+		if (E.table_fd != -1) editorDropPages(&E.text[at + j], sizeof(row) * n);
+	}
+	editorScratchFree(moved, sizeof(row) * count);
+	editorDamageRows(at, at + count - 1);
+
+	E.dirty++;
+}
+
+// keeps the rows at..at+count whose bit is set in keep and deletes the others
+void editorSelectRows(int at, int count, const unsigned char *keep)
+{
+	void editorIndexRelease();
+
+	if (at < 0 || count <= 0 || at + count > E.line_count) return;
+	editorIndexRelease();
+	editorJournalAppend(JOURNAL_SELECT_ROWS, at, count, 0, (const char *)keep, (count + 7) / 8);
+
+	int kept = 0, uncounted = 0;
+	int j;
+	for (j = 0; j < count; j++)
+	{
+		editorReleaseRows(at + j);
+		if (keep[j >> 3] & (1 << (j & 7))) {
+			// the kept rows trail behind, they are given back too
+			editorReleaseRows(at + kept);
+			E.text[at + kept++] = E.text[at + j];
+			continue;
+		}
+		if (at + j < E.word_scanned) {
+			editorWordsInSpan(&E.text[at + j], 0, E.text[at + j].size, -1);
+			uncounted++;
+		}
+		editorFreeRow(&E.text[at + j]);
+	}
+	E.word_scanned -= uncounted;
+	int tail = E.line_count - at - count;
+	for (j = 0; j < tail; j += RELEASE_ROWS)
+	{
+		int n = tail - j < RELEASE_ROWS ? tail - j : RELEASE_ROWS;
+		memmove(&E.text[at + kept + j], &E.text[at + count + j], sizeof(row) * n);
+		if (E.table_fd != -1) editorDropPages(&E.text[at + kept + j], sizeof(row) * (count - kept + n));
+	}
+	E.line_count -= count - kept;
+
+	// runs of dropped rows from the last one up, so the earlier ones keep their place
+	for (j = count; j > 0 && E.fold_count > 0; )
+	{
+		while (j > 0 && (keep[(j - 1) >> 3] & (1 << ((j - 1) & 7)))) j--;
+		int end = j;
+		while (j > 0 && !(keep[(j - 1) >> 3] & (1 << ((j - 1) & 7)))) j--;
+		if (end > j) editorFoldsDelete(at + j, end - j);
+	}
+	editorDamageRows(at, INT_MAX);
+
+	E.dirty++;
+}
+
+// Inserts c at column rx of the rows at..at+count, the rows ending before the
+// column are left alone. The whole block is one change in the journal, and the
+// rows are drawn again once, their renders are only rebuilt when they're shown.
+void editorBlockInsertChar(int at, int count, int rx, int c)
+{
+	void editorFillRows(int first, int count);
+
+	if (at < 0 || count <= 0 || at + count > E.line_count) return;
+	// the columns depend on the tab stop, which the journal may be replayed without
+	char change[2] = {c, E.tab_stop};
+	editorJournalAppend(JOURNAL_BLOCK_INSERT, at, count, rx, change, sizeof(change));
+	editorFillRows(at, count);
+	// recounting the words of a large block is left to the builder, it's the most of the work
+	if (count >= WORD_CHUNK) editorWordsRewind(0);
+
+	int j;
+	for (j = at; j < at + count; j++)
+	{
+		row *line = &E.text[j];
+		int cx = editorRowRxToCx(line, rx);
+		if (cx == -1) continue;
+
+		int counted = editorWordsCounted(line);
+		if (counted) editorWordsInSpan(line, cx, cx, -1);
+		editorRowWritable(line);
+		line->chars = realloc(line->chars, line->size + 2);
+		memmove(&line->chars[cx + 1], &line->chars[cx], line->size - cx + 1);
+		line->size++;
+		line->chars[cx] = c;
+		E.heap_bytes++;
+		if (counted) editorWordsInSpan(line, cx, cx + 1, 1);
+		editorRowDropRender(line);
+	}
+	editorDamageRows(at, at + count - 1);
+
+	E.dirty++;
+}
+
+// deletes the character at column rx of the rows at..at+count that reach past it
+void editorBlockDelChar(int at, int count, int rx)
+{
+	void editorFillRows(int first, int count);
+
+	if (at < 0 || count <= 0 || at + count > E.line_count || rx < 0) return;
+	char change[1] = {E.tab_stop};
+	editorJournalAppend(JOURNAL_BLOCK_DELETE, at, count, rx, change, sizeof(change));
+	editorFillRows(at, count);
+	if (count >= WORD_CHUNK) editorWordsRewind(0);
+
+	int j;
+	for (j = at; j < at + count; j++)
+	{
+		row *line = &E.text[j];
+		int cx = editorRowRxToCx(line, rx);
+		if (cx == -1 || cx == line->size) continue;
+
+		int counted = editorWordsCounted(line);
+		if (counted) editorWordsInSpan(line, cx, cx + 1, -1);
+		editorRowWritable(line);
+		memmove(&line->chars[cx], &line->chars[cx + 1], line->size - cx);
+		line->size--;
+		E.heap_bytes--;
+		if (counted) editorWordsInSpan(line, cx, cx, 1);
+		editorRowDropRender(line);
+	}
+	editorDamageRows(at, at + count - 1);
+
+	E.dirty++;
+}
+
+// the rows with a cursor of the block, none when there's no block
+int editorBlockRows(int *top)
+{
+	if (E.block_anchor == -1 || E.line_count == 0) return 0;
+
+	int a = E.block_anchor < E.line_count ? E.block_anchor : E.line_count - 1;
+	int b = E.cy < E.line_count ? E.cy : E.line_count - 1;
+	*top = a < b ? a : b;
+	return abs(a - b) + 1;
+}
+
+void editorInsertChar(int c)
+{
+	if (E.cy == E.line_count) {
+		editorInsertRow(E.line_count, "", 0);
+	}
+	editorRowInsertChar(&E.text[E.cy], E.cx, c);
+	E.cx++;
+}
+
+void editorInsertNewline()
+{
+	if (E.cx == 0) {
+		editorInsertRow(E.cy, "", 0);
+	} else {
+		row *line = &E.text[E.cy];
+		char *chars = editorRowChars(line);
+		editorInsertRow(E.cy + 1, &chars[E.cx], line->size - E.cx);
+		editorRowTruncate(&E.text[E.cy], E.cx);
+	}
+	E.cy++;
+	E.cx = 0;
+}
+
+void editorRowAppendString(row *line, const char *s, size_t len)
+{
+  editorJournalAppend(JOURNAL_APPEND_STRING, line - E.text, 0, 0, s, len);
+  int counted = editorWordsCounted(line);
+  int size = line->size;
+  if (counted) editorWordsInSpan(line, size, size, -1);
+  editorRowWritable(line);
+  line->chars = realloc(line->chars, line->size + len + 1);
+  memcpy(&line->chars[line->size], s, len);
+  line->size += len;
+  line->chars[line->size] = '\0';
+  E.heap_bytes += len;
+  if (counted) editorWordsInSpan(line, size, line->size, 1);
+  editorRowDropRender(line);
+  editorDamageRows(line - E.text, line - E.text);
+
+  E.dirty++;
+}
+
+void editorDelChar()
+{
+	if (E.cy == E.line_count) return;
+	if (E.cx == 0 && E.cy == 0) return;
+
+	row *line = &E.text[E.cy];
+	if (E.cx > 0) {
+		editorRowDelChar(line, E.cx - 1);
+		E.cx--;
+	} else {
+		E.cx = E.text[E.cy - 1].size;
+		editorRowAppendString(&E.text[E.cy - 1], editorRowChars(line), line->size);
+		editorDelRow(E.cy);
+		E.cy--;
+	}
+}
+
+int editorJournalReplay(const char *p, size_t len, size_t *consumed, int relog)
+{
+	size_t pos = 0;
+	int applied = 0;
+
+	E.journal_replaying = !relog;
+	while (pos + JOURNAL_RECORD_HEADER + sizeof(uint32_t) <= len)
+	{
+		int32_t args[4];
+		uint32_t sum;
+		memcpy(args, &p[pos + 1], sizeof(args));
+		if (args[3] < 0 || pos + JOURNAL_RECORD_HEADER + args[3] + sizeof(sum) > len) break;
+
+		const char *s = &p[pos + JOURNAL_RECORD_HEADER];
+		memcpy(&sum, &s[args[3]], sizeof(sum));
+		if (journalChecksum(2166136261u, &p[pos], JOURNAL_RECORD_HEADER + args[3]) != sum) break;
+
+		int op = p[pos];
+		if (op != JOURNAL_CHECKPOINT && op != JOURNAL_INSERT_ROW && op != JOURNAL_INSERT_ROWS &&
+			(args[0] < 0 || args[0] >= E.line_count)) break;
+
+		switch (op)
+		{
+			case JOURNAL_CHECKPOINT:
+				if (args[0] != E.line_count) goto done;
+				E.cy = args[1];
+				E.cx = args[2];
+				break;
+			case JOURNAL_INSERT_ROW:
+				editorInsertRow(args[0], s, args[3]);
+				break;
+			case JOURNAL_INSERT_ROWS:
+				if (args[0] < 0 || args[0] > E.line_count) goto done;
+				editorInsertRows(args[0], s, args[3]);
+				break;
+			case JOURNAL_DELETE_ROW:
+				editorDelRow(args[0]);
+				break;
+			case JOURNAL_INSERT_CHAR:
+				editorRowInsertChar(&E.text[args[0]], args[1], args[2]);
+				break;
+			case JOURNAL_DELETE_CHAR:
+				editorRowDelChar(&E.text[args[0]], args[1]);
+				break;
+			case JOURNAL_APPEND_STRING:
+				editorRowAppendString(&E.text[args[0]], s, args[3]);
+				break;
+			case JOURNAL_TRUNCATE_ROW:
+				editorRowTruncate(&E.text[args[0]], args[1]);
+				break;
+			case JOURNAL_PERMUTE_ROWS:
+			{
+				if (args[1] <= 0 || args[3] != (int)sizeof(int32_t) * args[1]) goto done;
+				int32_t *order = malloc(args[3]);
+				memcpy(order, s, args[3]);
+				editorPermuteRows(args[0], args[1], order);
+				free(order);
+				break;
+			}
+			case JOURNAL_SELECT_ROWS:
+				if (args[1] <= 0 || args[3] != (args[1] + 7) / 8) goto done;
+				editorSelectRows(args[0], args[1], (const unsigned char *)s);
+				break;
+			case JOURNAL_BLOCK_INSERT:
+			case JOURNAL_BLOCK_DELETE:
+			{
+				if (args[3] != (op == JOURNAL_BLOCK_INSERT ? 2 : 1) || s[args[3] - 1] <= 0) goto done;
+				int tab_stop = E.tab_stop;
+				E.tab_stop = s[args[3] - 1];
+				if (op == JOURNAL_BLOCK_INSERT)
+					editorBlockInsertChar(args[0], args[1], args[2], (unsigned char)s[0]);
+				else
+					editorBlockDelChar(args[0], args[1], args[2]);
+				E.tab_stop = tab_stop;
+				break;
+			}
+			default:
+				goto done;
+		}
+		if (op != JOURNAL_CHECKPOINT) applied++;
+		pos += JOURNAL_RECORD_HEADER + args[3] + sizeof(sum);
+	}
+
+done:
+	E.journal_replaying = 0;
+	*consumed = pos;
+
+	if (E.cy > E.line_count || E.cy < 0) E.cy = E.line_count;
+	if (E.cy < E.line_count) editorRowChars(&E.text[E.cy]);
+	int rowlen = E.cy < E.line_count ? E.text[E.cy].size : 0;
+	if (E.cx > rowlen || E.cx < 0) E.cx = rowlen;
+
+	return applied;
+}
+
+// Replays the records of the journal a chunk at a time, so only the largest of them
+// has to fit in memory. Stops at the first damaged one, *good is set to the length of
+// the intact records after the header.
+int editorJournalReplayFile(int fd, off_t size, off_t *good)
+{
+	buffer data = BUFFER_INIT;
+	char chunk[SAVE_CHUNK];
+	int applied = 0;
+
+	*good = 0;
+	while (1)
+	{
+		ssize_t n = read(fd, chunk, sizeof(chunk));
+		if (n == -1 && errno == EINTR) continue;
+		if (n > 0) bufferAppend(&data, chunk, n);
+
+		size_t consumed;
+		applied += editorJournalReplay(data.b, data.len, &consumed, 0);
+		if (consumed > 0) memmove(data.b, &data.b[consumed], data.len - consumed);
+		data.len -= consumed;
+		*good += consumed;
+		if (n <= 0) break;
+
+		// a record left over whole, or longer than the rest of the file, was refused
+		if (data.len >= JOURNAL_RECORD_HEADER) {
+			int32_t len;
+			memcpy(&len, &data.b[1 + 3 * sizeof(int32_t)], sizeof(len));
+			off_t end = *good + JOURNAL_RECORD_HEADER + (off_t)len + sizeof(uint32_t);
+			if (len < 0 || end > size - (off_t)sizeof(journalHeader) || end - *good <= (off_t)data.len) break;
+		}
+	}
+	free(data.b);
+	return applied;
+}
+
+// Journals that can't be replayed whole are kept next to it instead of removed,
+// the status messages only name the file.
+const char *editorJournalAsideName(const char *aside)
+{
+	const char *name = strrchr(aside, '/');
+	return name ? name + 1 : aside;
+}
+
+char *editorJournalAside()
+{
+	char *aside = malloc(strlen(E.journal_path) + 5);
+	if (aside == NULL) die("EditorJournalAside: malloc");
+	sprintf(aside, "%s.old", E.journal_path);
+	return aside;
+}
+
+void editorJournalRecover()
+{
+	void editorSetStatusMessage(int duration, const char *fmt, ...);
+	void editorClearStatusMessage();
+
+	// nobody to ask, the journal is left for the next interactive open
+	if (E.headless) {
+		if (access(E.journal_path, F_OK) == 0) {
+			free(E.journal_path);
+			E.journal_path = NULL;
+		}
+		return;
+	}
+
+	int fd = open(E.journal_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return;
+
+	struct stat st;
+	journalHeader header;
+	if (fstat(fd, &st) == -1 || st.st_size <= (off_t)sizeof(header) ||
+		read(fd, &header, sizeof(header)) != sizeof(header)) {
+		// not a single edit in it
+		close(fd);
+		unlink(E.journal_path);
+		return;
+	}
+
+	char *aside = editorJournalAside();
+	if (memcmp(&header, &E.journal_base, sizeof(header)) != 0) {
+		close(fd);
+		if (rename(E.journal_path, aside) == 0)
+			editorSetStatusMessage(5, "the journal is for another version of the file, kept in %s", editorJournalAsideName(aside));
+		else
+			unlink(E.journal_path);
+		free(aside);
+		return;
+	}
+
+	editorSetStatusMessage(0, "Unsaved changes found in %s. Recover them? (y/N)", E.journal_path);
+	int reply = editorReadKey();
+	editorClearStatusMessage();
+	if (reply != 'y' && reply != 'Y') {
+		close(fd);
+		unlink(E.journal_path);
+		free(aside);
+		return;
+	}
+
+	off_t good;
+	int applied = editorJournalReplayFile(fd, st.st_size, &good);
+	good += sizeof(header);
+
+	// the damaged end is copied aside before the journal is cut back to the intact records
+	int kept = 0;
+	if (good < st.st_size) {
+		int out = open(aside, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		loff_t from = 0;
+		ssize_t n = 1;
+		while (out != -1 && from < st.st_size && n > 0)
+			n = copy_file_range(fd, &from, out, NULL, st.st_size - from, 0);
+		kept = out != -1 && from == st.st_size;
+		if (out != -1) close(out);
+	}
+	close(fd);
+
+	// keep appending after the last intact record
+	E.journal_fd = open(E.journal_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (E.journal_fd != -1 && ftruncate(E.journal_fd, good) == -1) {
+		close(E.journal_fd);
+		E.journal_fd = -1;
+	}
+	E.journal_synced_at = monotonicMillis();
+	if (good == st.st_size)
+		editorSetStatusMessage(5, "%d edits recovered", applied);
+	else if (kept)
+		editorSetStatusMessage(5, "%d edits recovered, the rest was damaged, kept in %s", applied, editorJournalAsideName(aside));
+	else
+		editorSetStatusMessage(5, "%d edits recovered, the rest of the journal was damaged", applied);
+	free(aside);
+}
+
+// indexes the mapped file from a line start, the rows refer to the mapping until changed
+void editorMapRow(row *line, char *p, int size)
+{
+	line->size = size;
+	line->rsize = 0;
+	line->chars = p;
+	line->render = NULL;
+	line->offset = p - E.map;
+	line->spill = -1;
+	line->disk_size = size;
+	line->flags = ROW_MAPPED;
+}
+
+void editorLoadMappedRows(off_t from)
+{
+	char *p = &E.map[from];
+	char *end = &E.map[E.map_size];
+	char *released = p;
+
+	madvise(E.map, E.map_size, MADV_SEQUENTIAL);
+	while (p < end)
+	{
+		char *nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		char *q = eol;
+		while (q > p && q[-1] == '\r') q--;
+		if (nl == NULL || q != eol) E.disk_exact = 0;
+
+		editorReserveRows(E.line_count + 1);
+		editorMapRow(&E.text[E.line_count++], p, q - p);
+		editorReleaseRows(E.line_count);
+
+		p = nl ? nl + 1 : end;
+		if (E.mem_limit && p - released >= OPEN_CHUNK) {
+			editorDropPages(released, p - released);
+			released = p;
+		}
+	}
+	madvise(E.map, E.map_size, MADV_NORMAL);
+}
+
+char *editorIndexPath(const char *filename, uint64_t *hash)
+{
+	char *path = realpath(filename, NULL);
+	if (path == NULL) return NULL;
+
+	*hash = 14695981039346656037ull;
+	const char *p;
+	for (p = path; *p; p++)
+		*hash = (*hash ^ (unsigned char)*p) * 1099511628211ull;
+	free(path);
+
+	char dir[256];
+	snprintf(dir, sizeof(dir), "%s/.cache", getenv("HOME"));
+	mkdir(dir, 0755);
+	snprintf(dir, sizeof(dir), "%s/.cache/ctxt", getenv("HOME"));
+	mkdir(dir, 0700);
+
+	size_t len = strlen(dir) + 32;
+	char *index = malloc(len);
+	snprintf(index, len, "%s/%016llx.idx", dir, (unsigned long long)*hash);
+	return index;
+}
+
+// eight bytes at a time, it's read over the whole of a file that grew
+uint64_t indexChecksum(const char *p, size_t len)
+{
+	uint64_t sum = 14695981039346656037ull ^ len;
+	size_t j;
+	for (j = 0; j + sizeof(uint64_t) <= len; j += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, &p[j], sizeof(word));
+		sum = (sum ^ word) * 0x9e3779b97f4a7c15ull;
+		sum ^= sum >> 29;
+	}
+	for (; j < len; j++)
+		sum = (sum ^ (unsigned char)p[j]) * 1099511628211ull;
+	return sum;
+}
+
+// both kinds of row table read back as zeros, so every row starts out missing
+void editorReserveMissingRows(int count)
+{
+	if (E.table_fd != -1) {
+		editorReserveRows(count);
+		return;
+	}
+
+	E.text = calloc(count ? count : 1, sizeof(row));
+	if (E.text == NULL) die("EditorReserveMissingRows: calloc");
+	E.text_cap = count;
+}
+
+// Maps the cached index of the file if it's still good for it, either as it
+// was or grown at the end like a log. The rows it covers are left missing and
+// the offset to scan the rest from is returned.
+off_t editorIndexLoad(const char *filename, struct stat *st)
+{
+	uint64_t hash;
+	char *path = editorIndexPath(filename, &hash);
+	if (path == NULL) return 0;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1) return 0;
+
+	lineIndexHeader header;
+	struct stat ist;
+	char *map = MAP_FAILED;
+	if (fstat(fd, &ist) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+		header.path_hash == hash && header.ino == (int64_t)st->st_ino &&
+		header.line_count >= 0 && header.line_count < INT_MAX &&
+		ist.st_size >= (off_t)(sizeof(header) + sizeof(uint64_t) * (header.line_count + 1)) &&
+		(header.size < st->st_size || (header.size == st->st_size &&
+		header.mtime_sec == st->st_mtim.tv_sec && header.mtime_nsec == st->st_mtim.tv_nsec)))
+		map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+
+	// a file that grew is only trusted if the part the index was made from is unchanged
+	uint64_t *starts = (uint64_t *)&map[sizeof(header)];
+	int count = header.line_count;
+	int ok = starts[count] <= (uint64_t)header.size;
+	if (ok && header.size < st->st_size) {
+		madvise(E.map, starts[count], MADV_SEQUENTIAL);
+		ok = indexChecksum(E.map, starts[count]) == header.checksum;
+		madvise(E.map, starts[count], MADV_NORMAL);
+	}
+	if (!ok) {
+		munmap(map, ist.st_size);
+		return 0;
+	}
+
+	E.line_index = starts;
+	E.index_size = ist.st_size;
+	E.index_count = count;
+	editorReserveMissingRows(count);
+	E.line_count = count;
+	E.disk_exact = header.exact;
+	return starts[count];
+}
+
+// Writes the index after a scan, or appends the lines a grown file gained to
+// the one that was loaded.
+void editorIndexStore(struct stat *st)
+{
+	int from = E.line_index ? E.index_count : 0;
+	int covered = E.line_count;
+	off_t end = E.map_size;
+	if (covered > 0 && E.map[E.map_size - 1] != '\n') end = E.text[--covered].offset;
+	if (E.line_index && covered == from) return;
+
+	uint64_t hash;
+	char *path = editorIndexPath(E.filename, &hash);
+	if (path == NULL) return;
+
+	size_t len = strlen(path) + 5;
+	char *tmp = malloc(len);
+	snprintf(tmp, len, "%s.tmp", path);
+
+	int fd = E.line_index ? open(path, O_WRONLY | O_CLOEXEC) : open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) goto done;
+
+	lineIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.path_hash = hash;
+	header.ino = st->st_ino;
+	header.size = st->st_size;
+	header.mtime_sec = st->st_mtim.tv_sec;
+	header.mtime_nsec = st->st_mtim.tv_nsec;
+	header.line_count = covered;
+	header.exact = E.disk_exact && end == (off_t)E.map_size;
+	header.checksum = indexChecksum(E.map, end);
+
+	// the entry at from is already there when appending, it's where the file ended
+	buffer chunk = BUFFER_INIT;
+	off_t at = sizeof(header) + sizeof(uint64_t) * (E.line_index ? from + 1 : 0);
+	int failed = 0;
+	int j;
+	for (j = E.line_index ? from + 1 : 0; j <= covered && !failed; j++)
+	{
+		uint64_t start = j < covered ? (uint64_t)E.text[j].offset : (uint64_t)end;
+		bufferAppend(&chunk, (char *)&start, sizeof(start));
+		if (chunk.len >= SAVE_CHUNK || j == covered) {
+			failed = pwriteAll(fd, chunk.b, chunk.len, at) == -1;
+			at += chunk.len;
+			chunk.len = 0;
+		}
+	}
+	free(chunk.b);
+
+	// the header goes last, so a torn write leaves the old index intact
+	if (!failed) failed = pwriteAll(fd, (char *)&header, sizeof(header), 0) == -1;
+	close(fd);
+	if (!E.line_index) {
+		if (failed || rename(tmp, path) == -1) unlink(tmp);
+	}
+
+done:
+	free(tmp);
+	free(path);
+}
+
+// rows covered by the line index are filled in from it when first needed
+void editorIndexRows(int first, int count)
+{
+	if (first < 0) {
+		count += first;
+		first = 0;
+	}
+	if (count > E.index_count - first) count = E.index_count - first;
+
+	int j;
+	for (j = first; j < first + count; j++)
+	{
+		// releasing the index fills every row, which walks the whole table and file
+		if (j > first && j % RELEASE_ROWS == 0) {
+			editorReleaseRows(j);
+			if (E.mem_limit && editorResidentBytes() > E.mem_limit) editorDropBufferPages();
+		}
+
+		row *line = &E.text[j];
+		if (!editorRowMissing(line)) continue;
+
+		char *p = &E.map[E.line_index[j]];
+		char *q = &E.map[E.line_index[j + 1] - 1];
+		while (q > p && q[-1] == '\r') q--;
+		editorMapRow(line, p, q - p);
+	}
+}
+
+// where row j starts in the file, rows the index hasn't filled in yet are read off it
+off_t editorRowOffset(int j)
+{
+	if (j < E.index_count && editorRowMissing(&E.text[j])) return E.line_index[j];
+	return E.text[j].offset;
+}
+
+// Rows only line up with the index until one is inserted or deleted, so every
+// missing row is filled in before that and the index is let go.
+void editorIndexRelease()
+{
+	if (E.line_index == NULL) return;
+
+	editorIndexRows(0, E.index_count);
+	munmap((char *)E.line_index - sizeof(lineIndexHeader), E.index_size);
+	E.line_index = NULL;
+	E.index_size = 0;
+	E.index_count = 0;
+}
+
+void editorOpen(char *filename)
+{
+	void editorWatch();
+
+	free(E.filename);
+	E.filename = strdup(filename);
+
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) die("EditorOpen: open");
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) die("EditorOpen: fstat");
+
+	E.disk_exact = 1;
+	if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+		(E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		close(fd);
+		E.map_size = st.st_size;
+		E.map_ino = st.st_ino;
+		E.disk_size = st.st_size;
+
+		// A NUL near the start makes it a binary file, shown in hex without reading
+		// its lines. Unless there are changes to recover, those need the rows.
+		char *journal = editorJournalPath(filename);
+		size_t sniff = E.map_size < HEX_SNIFF ? E.map_size : HEX_SNIFF;
+		if (!E.headless && memchr(E.map, '\0', sniff) && access(journal, F_OK) == -1) {
+			E.hex_view = 1;
+			E.hex_pending = 1;
+		} else {
+			editorLoadMappedRows(editorIndexLoad(filename, &st));
+			if (E.map_size >= INDEX_MIN_SIZE) editorIndexStore(&st);
+		}
+		free(journal);
+	} else {
+		E.map = NULL;
+		FILE *fp = fdopen(fd, "r");
+		if (!fp) die("EditorOpen: fdopen");
+
+		char *line = NULL;
+		size_t linecap = 0;
+		ssize_t linelen;
+		off_t offset = 0;
+
+		while ((linelen = getline(&line, &linecap, fp)) != -1)
+		{
+			ssize_t size = linelen;
+			while (size > 0 && (line[size - 1] == '\n' || line[size - 1] == '\r'))
+				size--;
+			if (linelen - size != 1 || line[size] != '\n') E.disk_exact = 0;
+
+			editorInsertRow(E.line_count, line, size);
+			E.text[E.line_count - 1].offset = offset;
+			E.text[E.line_count - 1].disk_size = size;
+			E.text[E.line_count - 1].flags &= ~ROW_MODIFIED;
+			offset += linelen;
+		}
+		free(line);
+		fclose(fp);
+		E.disk_size = offset;
+	}
+	E.dirty = 0;
+
+	free(E.journal_path);
+	E.journal_path = editorJournalPath(filename);
+	editorJournalSetBase(filename);
+	editorJournalRecover();
+	editorWatch();
+}
+
+#define LINE_HASH_INIT 14695981039346656037ull
+
+uint64_t lineHashByte(uint64_t hash, unsigned char c)
+{
+	return (hash ^ c) * 1099511628211ull;
+}
+
+uint64_t lineHash(const char *s, int len)
+{
+	uint64_t hash = LINE_HASH_INIT;
+	int j;
+	for (j = 0; j < len; j++)
+		hash = lineHashByte(hash, s[j]);
+	return hash;
+}
+
+typedef struct
+{
+	// old[o0..o1) is replaced by new[n0..n1)
+	int o0, o1, n0, n1;
+} diffHunk;
+
+typedef struct
+{
+	// hashes of the old and new lines
+	const uint64_t *old, *new;
+	diffHunk *hunks;
+	int hunk_count, hunk_cap;
+	int *forward, *backward;
+	long long budget;
+} diffContext;
+
+// Hunks are found in order, one that starts where the last one ended is joined to it.
+void diffReplace(diffContext *d, int o0, int o1, int n0, int n1)
+{
+	if (o0 == o1 && n0 == n1) return;
+
+	diffHunk *last = d->hunk_count ? &d->hunks[d->hunk_count - 1] : NULL;
+	if (last && last->o1 == o0 && last->n1 == n0) {
+		last->o1 = o1;
+		last->n1 = n1;
+		return;
+	}
+	if (d->hunk_count == d->hunk_cap) {
+		d->hunk_cap = d->hunk_cap ? d->hunk_cap * 2 : 64;
+		d->hunks = realloc(d->hunks, sizeof(diffHunk) * d->hunk_cap);
+		if (d->hunks == NULL) die("DiffReplace: realloc");
+	}
+	d->hunks[d->hunk_count++] = (diffHunk){o0, o1, n0, n1};
+}
+
+// Myers' linear space diff: the middle snake of the two ranges is found by
+// searching from both ends at once, then the parts before and after it are
+// diffed the same way. Ranges that take more than DIFF_MAX_COST edits, or once
+// the budget is spent, are taken as replaced whole.
+void diffRange(diffContext *d, int o0, int o1, int n0, int n1)
+{
+	int n = o1 - o0, m = n1 - n0;
+	if (n == 0 || m == 0) {
+		diffReplace(d, o0, o1, n0, n1);
+		return;
+	}
+
+	int l = n + m, w = n - m;
+	int z = 2 * (n < m ? n : m);
+	if (z > 2 * DIFF_MAX_COST) z = 2 * DIFF_MAX_COST;
+	z += 2;
+	memset(d->forward, 0, sizeof(int) * z);
+	memset(d->backward, 0, sizeof(int) * z);
+
+	int h;
+	for (h = 0; h <= l / 2 + l % 2 && h <= DIFF_MAX_COST && d->budget > 0; h++)
+	{
+		int r;
+		for (r = 0; r < 2; r++)
+		{
+			int *c = r == 0 ? d->forward : d->backward;
+			int *other = r == 0 ? d->backward : d->forward;
+			int o = r == 0;
+			int k;
+			for (k = -(h - 2 * (h > m ? h - m : 0)); k <= h - 2 * (h > n ? h - n : 0); k += 2)
+			{
+				int prev = (((k - 1) % z) + z) % z, next = (((k + 1) % z) + z) % z;
+				int a = (k == -h || (k != h && c[prev] < c[next])) ? c[next] : c[prev] + 1;
+				int b = a - k;
+				int s = a, t = b;
+				while (a < n && b < m &&
+					d->old[o ? o0 + a : o1 - 1 - a] == d->new[o ? n0 + b : n1 - 1 - b]) {
+					a++;
+					b++;
+				}
+				d->budget -= a - s + 1;
+				c[((k % z) + z) % z] = a;
+
+				int y = w - k;
+				if (l % 2 == o && y >= -(h - o) && y <= h - o && a + other[((y % z) + z) % z] >= n) {
+					int cost = o ? 2 * h - 1 : 2 * h;
+					int x0 = o ? s : n - a, y0 = o ? t : m - b;
+					int x1 = o ? a : n - s, y1 = o ? b : m - t;
+					if (cost > 1 || (x0 != x1 && y0 != y1)) {
+						diffRange(d, o0, o0 + x0, n0, n0 + y0);
+						diffRange(d, o0 + x1, o1, n0 + y1, n1);
+					} else if (m > n) {
+						diffReplace(d, o1, o1, n0 + n, n1);
+					} else if (m < n) {
+						diffReplace(d, o0 + m, o1, n0 + m, n0 + m);
+					}
+					return;
+				}
+			}
+		}
+	}
+	diffReplace(d, o0, o1, n0, n1);
+}
+
+// The hunks that turn the old lines into the new ones, in order. The lines both
+// start and end with are skipped before diffing.
+diffHunk *diffLines(const uint64_t *old, int old_count, const uint64_t *new, int count, int *hunk_count)
+{
+	diffContext d;
+	d.old = old;
+	d.new = new;
+	d.hunks = NULL;
+	d.hunk_count = d.hunk_cap = 0;
+	d.forward = malloc(sizeof(int) * (2 * DIFF_MAX_COST + 2));
+	d.backward = malloc(sizeof(int) * (2 * DIFF_MAX_COST + 2));
+	d.budget = DIFF_BUDGET;
+
+	int prefix = 0, suffix = 0;
+	while (prefix < count && prefix < old_count && new[prefix] == old[prefix]) prefix++;
+	while (suffix < count - prefix && suffix < old_count - prefix &&
+		new[count - 1 - suffix] == old[old_count - 1 - suffix]) suffix++;
+	diffRange(&d, prefix, old_count - suffix, prefix, count - suffix);
+	free(d.forward);
+	free(d.backward);
+
+	*hunk_count = d.hunk_count;
+	return d.hunks;
+}
+
+// where an old line ends up, one inside a hunk goes to the line replacing it or
+// the first one after
+int diffMapLine(const diffHunk *hunks, int hunk_count, int at)
+{
+	int shift = 0;
+	int j;
+	for (j = 0; j < hunk_count && at >= hunks[j].o0; j++)
+	{
+		const diffHunk *h = &hunks[j];
+		if (at < h->o1) {
+			int size = h->n1 - h->n0;
+			return h->n0 + (at - h->o0 < size ? at - h->o0 : size > 0 ? size - 1 : 0);
+		}
+		shift = h->n1 - h->o1;
+	}
+	return at + shift;
+}
+
+// Reloads a clean buffer after its file changed on disk. The rows are diffed
+// against the lines of the new file and only the hunks that differ are replaced,
+// the rows between them keep their render caches and are just pointed into the
+// new mapping. The cursor, the block anchor and folds move along with them.
+void editorReload()
+{
+	void editorSetStatusMessage(int duration, const char *fmt, ...);
+
+	int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return;
+
+	struct stat st;
+	char *map = NULL;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		(st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	editorIndexRelease();
+	int faults = E.map_faults;
+
+	if (E.hex_pending) {
+		if (E.map) munmap(E.map, E.map_size);
+		E.map = map;
+		E.map_size = st.st_size;
+		E.map_ino = st.st_ino;
+		E.disk_size = st.st_size;
+		if (E.hex_cursor >= E.disk_size) E.hex_cursor = E.disk_size ? E.disk_size - 1 : 0;
+		E.full_redraw = 1;
+		editorJournalCompact();
+		editorSetStatusMessage(5, "%s changed on disk", E.filename);
+		return;
+	}
+
+	// A file rewritten in place shows through the old mapping as well, so rows
+	// past its new end can't be read anymore. They just don't match.
+	int in_place = E.map && E.map_ino == st.st_ino;
+	off_t readable = in_place ? st.st_size : (off_t)E.map_size;
+
+	// where the lines of the new file start, the last entry is where it ends
+	E.loading_map = map;
+	E.loading_size = st.st_size;
+	int count = 0, cap = 1024;
+	off_t *starts = malloc(sizeof(off_t) * cap);
+	uint64_t *new = malloc(sizeof(uint64_t) * cap);
+	if (starts == NULL || new == NULL) die("EditorReload: malloc");
+	int exact = st.st_size == 0 || map[st.st_size - 1] == '\n';
+	if (map) madvise(map, st.st_size, MADV_SEQUENTIAL);
+	char *p = map, *end = map + st.st_size;
+	while (p < end)
+	{
+		if (count + 1 == cap) {
+			cap *= 2;
+			starts = realloc(starts, sizeof(off_t) * cap);
+			new = realloc(new, sizeof(uint64_t) * cap);
+			if (starts == NULL || new == NULL) die("EditorReload: realloc");
+		}
+		char *nl = memchr(p, '\n', end - p);
+		char *eol = nl ? nl : end;
+		char *q = eol;
+		while (q > p && q[-1] == '\r') q--;
+		if (q != eol) exact = 0;
+
+		starts[count] = p - map;
+		new[count++] = lineHash(p, q - p);
+		p = nl ? nl + 1 : end;
+	}
+	starts[count] = st.st_size;
+
+	// spilled rows are read without being loaded back
+	uint64_t *old = malloc(sizeof(uint64_t) * (E.line_count + 1));
+	if (old == NULL) die("EditorReload: malloc");
+	buffer copy = BUFFER_INIT;
+	int j;
+	for (j = 0; j < E.line_count; j++)
+	{
+		editorReleaseRows(j);
+		row *line = &E.text[j];
+		if ((line->flags & ROW_MAPPED) && line->offset + line->size > readable) {
+			old[j] = ~lineHash((char *)&j, sizeof(j));
+			continue;
+		}
+		copy.len = 0;
+		editorRowCopy(line, &copy);
+		old[j] = lineHash(copy.b, copy.len);
+	}
+	free(copy.b);
+
+	int hunk_count;
+	diffHunk *hunks = diffLines(old, E.line_count, new, count, &hunk_count);
+	free(old);
+	free(new);
+
+	int deleted = 0, inserted = 0;
+	for (j = 0; j < hunk_count; j++)
+	{
+		deleted += hunks[j].o1 - hunks[j].o0;
+		inserted += hunks[j].n1 - hunks[j].n0;
+	}
+
+	// the old text of a file rewritten in place can't be read back to take its words out
+	editorWordsRewind(in_place ? 0 : hunk_count ? hunks[0].o0 : E.line_count);
+
+	// from the last hunk up, the ones before it still have their old places
+	for (j = hunk_count - 1; j >= 0; j--)
+	{
+		diffHunk *h = &hunks[j];
+		editorFoldsDelete(h->o0, h->o1 - h->o0);
+		editorFoldsInsert(h->o0, h->n1 - h->n0);
+
+		int k;
+		for (k = h->o0; k < h->o1; k++)
+			editorFreeRow(&E.text[k]);
+	}
+	E.cy = diffMapLine(hunks, hunk_count, E.cy);
+	if (E.block_anchor != -1) E.block_anchor = diffMapLine(hunks, hunk_count, E.block_anchor);
+
+	// The kept runs of rows slide to their new places. Runs going up are moved
+	// first to last and runs going down last to first, neither lands on rows that
+	// haven't been moved yet.
+	editorReserveRows(count);
+	int pass;
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (j = 0; j <= hunk_count; j++)
+		{
+			int run = pass == 0 ? j : hunk_count - j;
+			int from = run ? hunks[run - 1].o1 : 0;
+			int to = run ? hunks[run - 1].n1 : 0;
+			int size = (run < hunk_count ? hunks[run].o0 : E.line_count) - from;
+			if (size > 0 && (pass == 0 ? to < from : to > from))
+				memmove(&E.text[to], &E.text[from], sizeof(row) * size);
+		}
+	}
+
+	char *old_map = E.map;
+	size_t old_size = E.map_size;
+	E.map = map;
+	E.map_size = st.st_size;
+	E.map_ino = st.st_ino;
+	E.line_count = count;
+	E.loading_map = NULL;
+
+	int hunk = 0;
+	for (j = 0; j < count; j++)
+	{
+		editorReleaseRows(j);
+		row *line = &E.text[j];
+		char *chars = &map[starts[j]];
+		int size = starts[j + 1] - starts[j];
+		if (size > 0 && chars[size - 1] == '\n') size--;
+		while (size > 0 && chars[size - 1] == '\r') size--;
+
+		while (hunk < hunk_count && j >= hunks[hunk].n1) hunk++;
+		if (hunk < hunk_count && j >= hunks[hunk].n0) {
+			editorMapRow(line, chars, size);
+			continue;
+		}
+
+		// a row that only hashed the same is replaced after all
+		if (!(line->flags & ROW_SPILLED) &&
+			(line->size != size || memcmp(editorRowChars(line), chars, size) != 0)) {
+			editorFreeRow(line);
+			editorMapRow(line, chars, size);
+			continue;
+		}
+		if (line->flags & ROW_MAPPED) line->chars = chars;
+		line->offset = starts[j];
+		line->disk_size = line->size;
+		if (in_place) editorRowDropRender(line);
+	}
+	if (old_map) munmap(old_map, old_size);
+	free(starts);
+
+	int rowlen = E.cy < E.line_count ? E.text[E.cy].size : 0;
+	if (E.cx > rowlen) E.cx = rowlen;
+	if (in_place)
+		editorDamageRows(0, INT_MAX);
+	else if (hunk_count)
+		editorDamageRows(hunks[0].n0, deleted == inserted ? hunks[hunk_count - 1].n1 : INT_MAX);
+	else
+		editorDamageRows(INT_MAX, -1);
+	free(hunks);
+
+	E.disk_size = st.st_size;
+	E.disk_exact = exact;
+	E.dirty = 0;
+	// a file cut short while it was read is read again once it settles
+	if (E.map_faults != faults) {
+		E.disk_event = monotonicMillis();
+		return;
+	}
+	editorJournalCompact();
+	editorSetStatusMessage(5, "%s changed on disk: %d lines replaced by %d", E.filename, deleted, inserted);
+}
+
+// the directory is watched, files saved by renaming a new one over them stay covered
+void editorWatch()
+{
+	if (E.inotify_fd == -1 || E.filename == NULL || E.watch_wd != -1) return;
+
+	char *path = realpath(E.filename, NULL);
+	if (path == NULL) return;
+	*strrchr(path, '/') = '\0';
+
+	E.watch_wd = inotify_add_watch(E.inotify_fd, path[0] ? path : "/",
+		IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE);
+	free(path);
+}
+
+// A file changed in place no longer backs the rows mapped from it, what was cut off
+// faults and the rest may be rewritten under them. The rows of a changed buffer
+// are read out of the file as it is now, a block at a time, and the mapping is let
+// go. Rows past its new end come back short, the number of them is returned.
+int editorDetachMap()
+{
+	int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+	char *window = malloc(DETACH_CHUNK);
+	if (window == NULL) die("EditorDetachMap: malloc");
+	off_t window_at = 0;
+	ssize_t window_len = 0;
+	int lost = 0;
+
+	int j;
+	for (j = 0; j < E.line_count; j++)
+	{
+		editorReleaseRows(j);
+		row *line = &E.text[j];
+		int indexed = editorRowMissing(line) && j < E.index_count;
+		off_t offset;
+		int size;
+		if (indexed) {
+			offset = E.line_index[j];
+			size = E.line_index[j + 1] - 1 - offset;
+		} else if (line->flags & ROW_MAPPED) {
+			offset = line->chars - E.map;
+			size = line->size;
+		} else {
+			continue;
+		}
+
+		char *chars = malloc(size + 1);
+		if (chars == NULL) die("EditorDetachMap: malloc");
+		ssize_t got = 0;
+		if (size > DETACH_CHUNK) {
+			got = fd == -1 ? 0 : pread(fd, chars, size, offset);
+		} else {
+			if (offset < window_at || offset + size > window_at + window_len) {
+				window_at = offset;
+				window_len = fd == -1 ? 0 : pread(fd, window, DETACH_CHUNK, offset);
+				if (window_len < 0) window_len = 0;
+			}
+			got = window_at + window_len - offset;
+			if (got > size) got = size;
+			if (got > 0) memcpy(chars, &window[offset - window_at], got);
+		}
+		if (got < 0) got = 0;
+		if (got < size) lost++;
+		if (indexed) {
+			while (got > 0 && chars[got - 1] == '\r') got--;
+			line->offset = offset;
+			line->spill = -1;
+		}
+		chars[got] = '\0';
+
+		editorRowDropRender(line);
+		line->chars = chars;
+		line->size = got;
+		line->disk_size = got;
+		line->flags &= ~ROW_MAPPED;
+		E.heap_bytes += got + 1;
+		if (E.mem_limit && E.heap_bytes > E.mem_limit / 4) editorRowSpill(line);
+	}
+	free(window);
+	if (fd != -1) close(fd);
+
+	editorIndexRelease();
+	munmap(E.map, E.map_size);
+	E.map = NULL;
+	E.map_size = 0;
+	// the rows don't line up with the file any more, and may not read as they did
+	E.disk_exact = 0;
+	E.hex_view = 0;
+	editorWordsRewind(0);
+	editorDamageRows(0, INT_MAX);
+	E.full_redraw = 1;
+	return lost;
+}
+
+// Runs once events for the file have settled. Writes of our own leave the file
+// as the journal base recorded it and are ignored.
+void editorCheckDisk()
+{
+	void editorSetStatusMessage(int duration, const char *fmt, ...);
+
+	if (E.disk_event == 0 && !E.map_damaged) return;
+	// a changed buffer stops reading from the file at once, a reload waits for the writes to settle
+	if (!E.map_damaged && !(E.dirty && E.map) && monotonicMillis() - E.disk_event < WATCH_SETTLE) return;
+	E.disk_event = 0;
+
+	struct stat st;
+	if (E.filename == NULL || stat(E.filename, &st) == -1) return;
+	if (st.st_size == E.journal_base.size && st.st_mtim.tv_sec == E.journal_base.mtime_sec &&
+		st.st_mtim.tv_nsec == E.journal_base.mtime_nsec) return;
+
+	if (!E.dirty) {
+		editorReload();
+		return;
+	}
+	// a file replaced by another one stays mapped as it was
+	int lost = E.map && st.st_ino == E.map_ino ? editorDetachMap() : 0;
+	if (lost) {
+		E.disk_changed = 1;
+		editorSetStatusMessage(5, "%s got shorter on disk, %d lines of it are lost. Saving will ask before overwriting it",
+			E.filename, lost);
+	} else if (!E.disk_changed) {
+		E.disk_changed = 1;
+		editorSetStatusMessage(5, "%s changed on disk, saving will ask before overwriting it", E.filename);
+	}
+}
+
+void editorWatchEvents()
+{
+	if (E.inotify_fd == -1) return;
+
+	uint64_t events[512];
+	ssize_t n;
+	while ((n = read(E.inotify_fd, events, sizeof(events))) > 0)
+	{
+		char *p = (char *)events;
+		while (p < (char *)events + n)
+		{
+			struct inotify_event *event = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + event->len;
+			if (event->len == 0) continue;
+
+			int j;
+			for (j = 0; j < E.buffer_count; j++)
+			{
+				textBuffer *b = &E.buffers[j];
+				if (j == E.current_buffer) editorStoreBuffer(b);
+
+				const char *base = b->filename ? strrchr(b->filename, '/') : NULL;
+				base = base ? base + 1 : b->filename;
+				if (b->watch_wd == event->wd && base && strcmp(base, event->name) == 0)
+					b->disk_event = monotonicMillis();
+				if (j == E.current_buffer) editorLoadBuffer(b);
+			}
+		}
+	}
+	editorForEachBuffer(editorCheckDisk);
+	E.map_damaged = 0;
+}
+
+// Reading a page of a mapped file that was truncated under it raises SIGBUS. The
+// page is replaced with zeros so the rows read as NULs until the change is picked up.
+// A file being reloaded is covered as well.
+void editorMapFault(int sig, siginfo_t *info, void *context)
+{
+	(void)context;
+
+	char *addr = info->si_addr;
+	long page = sysconf(_SC_PAGESIZE);
+	int covered = E.loading_map && addr >= E.loading_map && addr < E.loading_map + E.loading_size;
+	int j;
+	for (j = -1; j < E.buffer_count && !covered; j++)
+	{
+		if (j == E.current_buffer) continue;
+		char *map = j == -1 ? E.map : E.buffers[j].map;
+		size_t size = j == -1 ? E.map_size : E.buffers[j].map_size;
+		covered = map && addr >= map && addr < map + size;
+	}
+
+	char *start = (char *)((uintptr_t)addr & ~(uintptr_t)(page - 1));
+	if (covered && mmap(start, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+		E.map_damaged = 1;
+		E.map_faults++;
+		return;
+	}
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void editorCatchMapFaults()
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = editorMapFault;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGBUS, &action, NULL);
+}
+
+// writes only the modified rows and the rows appended past the end of the file,
+// returns -1 with nothing written if the rows no longer line up with the file
+long long editorSavePartial(int fd)
+{
+	struct stat st;
+	if (!E.disk_exact || fstat(fd, &st) == -1 || st.st_size != E.disk_size) return -1;
+
+	off_t pos = 0;
+	int j;
+	for (j = 0; j < E.line_count && E.text[j].offset != -1; j++)
+	{
+		editorReleaseRows(j);
+		if (E.text[j].offset != pos || E.text[j].size != E.text[j].disk_size) return -1;
+		pos += E.text[j].size + 1;
+	}
+	if (pos != E.disk_size) return -1;
+	for (; j < E.line_count; j++)
+		if (E.text[j].offset != -1) return -1;
+
+	buffer chunk = BUFFER_INIT;
+	off_t start = 0;
+	long long written = 0;
+
+	pos = 0;
+	for (j = 0; j <= E.line_count; j++)
+	{
+		editorReleaseRows(j);
+		row *line = j < E.line_count ? &E.text[j] : NULL;
+		int flush = line == NULL || !(line->flags & ROW_MODIFIED) || chunk.len >= SAVE_CHUNK;
+
+		if (flush && chunk.len > 0) {
+			if (pwriteAll(fd, chunk.b, chunk.len, start) == -1) {
+				free(chunk.b);
+				return -2;
+			}
+			written += chunk.len;
+			chunk.len = 0;
+		}
+		if (line == NULL) break;
+
+		if (line->flags & ROW_MODIFIED) {
+			if (chunk.len == 0) start = pos;
+			bufferAppend(&chunk, editorRowChars(line), line->size);
+			bufferAppend(&chunk, "\n", 1);
+		}
+		pos += line->size + 1;
+	}
+	free(chunk.b);
+
+	return written;
+}
+
+// writes the rows from first on starting at offset from, and cuts the file off after them
+long long editorSaveRows(int fd, int first, off_t from)
+{
+	off_t total = 0;
+	int j;
+	for (j = 0; j < E.line_count; j++)
+		total += E.text[j].size + 1;
+
+	if (ftruncate(fd, total) == -1) return -2;
+
+	buffer chunk = BUFFER_INIT;
+	off_t pos = from;
+	for (j = first; j < E.line_count; j++)
+	{
+		editorReleaseRows(j);
+		editorRowCopy(&E.text[j], &chunk);
+		bufferAppend(&chunk, "\n", 1);
+		if (chunk.len >= SAVE_CHUNK || j == E.line_count - 1) {
+			if (pwriteAll(fd, chunk.b, chunk.len, pos) == -1) {
+				free(chunk.b);
+				return -2;
+			}
+			pos += chunk.len;
+			chunk.len = 0;
+		}
+	}
+	free(chunk.b);
+
+	return total;
+}
+
+long long editorSaveFull(int fd)
+{
+	return editorSaveRows(fd, 0, 0);
+}
+
+// Rewrites a mapped file in place. The rows before the first change are already
+// on disk and left alone. The rest of the old file is copied aside first and the
+// rows mapped from it read from the copy, since writing the file changes what its
+// mapping shows. The copy is handed back to be let go once the rows point into the
+// new file. Returns -1 with nothing written when there's no room for the copy.
+long long editorSaveInPlace(int fd, char **copy, size_t *copy_size)
+{
+	*copy = NULL;
+	*copy_size = 0;
+
+	// a file replaced since it was mapped doesn't share anything with the rows
+	struct stat st;
+	if (fstat(fd, &st) == -1) return -2;
+	if (st.st_ino != E.map_ino) return editorSaveFull(fd);
+
+	int first = 0;
+	off_t from = 0;
+	for (; E.disk_exact && first < E.line_count; first++)
+	{
+		editorReleaseRows(first);
+		row *line = &E.text[first];
+		if ((line->flags & ROW_MODIFIED) || line->offset != from || line->size != line->disk_size) break;
+		from += line->size + 1;
+	}
+	if (from >= (off_t)E.map_size) return editorSaveRows(fd, first, from);
+
+	size_t size = E.map_size - from;
+	int tmp = editorTempFile();
+	char *map = MAP_FAILED;
+	if (tmp != -1 && pwriteAll(tmp, &E.map[from], size, 0) == 0)
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, tmp, 0);
+	if (tmp != -1) close(tmp);
+	if (map == MAP_FAILED) return -1;
+
+	int j;
+	for (j = first; j < E.line_count; j++)
+	{
+		editorReleaseRows(j);
+		row *line = &E.text[j];
+		if ((line->flags & ROW_MAPPED) && line->chars >= &E.map[from] && line->chars < &E.map[E.map_size])
+			line->chars = &map[line->chars - &E.map[from]];
+	}
+
+	long long written = editorSaveRows(fd, first, from);
+	if (written < 0) {
+		// the file is half written, the rows read from the copy are kept in memory
+		for (j = first; j < E.line_count; j++)
+		{
+			editorReleaseRows(j);
+			row *line = &E.text[j];
+			if (!(line->flags & ROW_MAPPED) || line->chars < map || line->chars >= map + size) continue;
+
+			char *chars = malloc(line->size + 1);
+			if (chars == NULL) die("EditorSaveInPlace: malloc");
+			memcpy(chars, line->chars, line->size);
+			chars[line->size] = '\0';
+			line->chars = chars;
+			line->flags = (line->flags & ~ROW_MAPPED) | ROW_MODIFIED;
+			E.heap_bytes += line->size + 1;
+			if (E.mem_limit && E.heap_bytes > E.mem_limit / 4) editorRowSpill(line);
+		}
+		munmap(map, size);
+		return written;
+	}
+
+	*copy = map;
+	*copy_size = size;
+	return written;
+}
+
+// Writes a new file and renames it over the old one, when there's no room to copy
+// the old text aside and write in place. Mode and owner are carried over.
+long long editorSaveReplace()
+{
+	char *target = realpath(E.filename, NULL);
+	if (target == NULL) return -2;
+
+	size_t len = strlen(target) + 16;
+	char *tmp = malloc(len);
+	snprintf(tmp, len, "%s.ctxt-save", target);
+
+	long long written = -2;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd != -1) {
+		struct stat st;
+		if (stat(target, &st) == -1 || fchown(fd, st.st_uid, st.st_gid) == -1 ||
+			fchmod(fd, st.st_mode & 07777) == -1) {
+			// a file that would change hands isn't replaced
+			close(fd);
+			unlink(tmp);
+			free(tmp);
+			free(target);
+			return -2;
+		}
+
+		written = editorSaveFull(fd);
+		if (written >= 0 && (fsync(fd) == -1 || rename(tmp, target) == -1)) written = -2;
+		close(fd);
+		if (written < 0) unlink(tmp);
+	}
+
+	free(tmp);
+	free(target);
+	return written;
+}
+
+// once saved the rows can all point into the file again
+int editorRemapRows()
+{
+	int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return -1;
+
+	struct stat st;
+	char *map = NULL;
+	if (E.disk_size > 0) map = mmap(NULL, E.disk_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (fstat(fd, &st) == 0) E.map_ino = st.st_ino;
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+
+	int j;
+	for (j = 0; j < E.line_count; j++)
+	{
+		editorReleaseRows(j);
+		row *line = &E.text[j];
+		if (!(line->flags & (ROW_MAPPED | ROW_SPILLED))) {
+			E.heap_bytes -= line->size + 1;
+			free(line->chars);
+		}
+		line->chars = &map[line->offset];
+		line->flags = ROW_MAPPED;
+	}
+
+	if (E.spilled_rows && ftruncate(E.spill_fd, 0) == 0) {
+		E.spilled_rows = 0;
+		E.spill_size = 0;
+	}
+	munmap(E.map, E.map_size);
+	E.map = map;
+	E.map_size = E.disk_size;
+	malloc_trim(0);
+	return 0;
+}
+
+void editorSave()
+{
+	void editorSetStatusMessage(int duration, const char *fmt, ...);
+	void editorClearStatusMessage();
+	void editorRemoteSave();
+
+	if (E.remote_fd != -1) {
+		editorRemoteSave();
+		return;
+	}
+
+	if (E.hex_pending) {
+		editorSetStatusMessage(5, "nothing to save, the hex view doesn't change the file");
+		return;
+	}
+
+	if (E.filename == NULL) E.filename = "file.txt";
+	editorIndexRelease();
+
+	if (E.disk_changed) {
+		editorSetStatusMessage(0, "%s changed on disk since it was read. Overwrite it? (y/N)", E.filename);
+		int reply = editorReadKey();
+		editorClearStatusMessage();
+		if (reply != 'y' && reply != 'Y') return;
+	}
+
+	int fd = open(E.filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd != -1) {
+		int partial = E.partial_save;
+		char *copy = NULL;
+		size_t copy_size = 0;
+		long long written = partial ? editorSavePartial(fd) : -1;
+		if (written == -1) {
+			partial = 0;
+			written = E.map ? editorSaveInPlace(fd, &copy, &copy_size) : editorSaveFull(fd);
+			if (written == -1) written = editorSaveReplace();
+		}
+
+		if (written >= 0) {
+			close(fd);
+			E.dirty = 0;
+			E.disk_changed = 0;
+			E.diff_generation = -1;
+
+			off_t pos = 0;
+			int j;
+			for (j = 0; j < E.line_count; j++)
+			{
+				editorReleaseRows(j);
+				E.text[j].offset = pos;
+				E.text[j].disk_size = E.text[j].size;
+				E.text[j].flags &= ~ROW_MODIFIED;
+				pos += E.text[j].size + 1;
+			}
+			E.disk_size = pos;
+			E.disk_exact = 1;
+			// rows left reading from the copy keep it around
+			if (E.map && editorRemapRows() == 0 && copy) munmap(copy, copy_size);
+
+			struct stat st;
+			if (E.map && E.map_size >= INDEX_MIN_SIZE && stat(E.filename, &st) == 0)
+				editorIndexStore(&st);
+
+			if (E.journal_path == NULL) E.journal_path = editorJournalPath(E.filename);
+			editorJournalCompact();
+			editorWatch();
+			editorSetStatusMessage(5, "%lld bytes written to disk%s", written, partial ? " (in place)" : "");
+			return;
+		}
+		close(fd);
+	}
+
+	editorSetStatusMessage(5, "can't write to disk! I/O error: %s", strerror(errno));
+}
+
+// Without a runtime directory the socket goes into a directory of our own in /tmp,
+// one somebody else made first or left open to others isn't used.
+int editorSocketAddress(struct sockaddr_un *addr)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char fallback[64];
+
+	if (dir == NULL || *dir == '\0') {
+		snprintf(fallback, sizeof(fallback), "/tmp/ctxt-%d", (int)getuid());
+		struct stat st;
+		if (mkdir(fallback, 0700) == -1 && errno != EEXIST) return -1;
+		if (lstat(fallback, &st) == -1) return -1;
+		if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+			errno = EPERM;
+			return -1;
+		}
+		dir = fallback;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/ctxt.sock", dir);
+	return 0;
+}
+
+// only processes of the same user talk to each other over the socket
+int socketPeerIsUs(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+int sendAll(int fd, const char *b, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = send(fd, b, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void editorRemoteWrite(const char *b, size_t len)
+{
+	if (sendAll(E.remote_fd, b, len) == -1) die("EditorRemote: send");
+}
+
+void editorRemoteRead(char *b, size_t len)
+{
+	while (len > 0)
+	{
+		if (E.remote_in_start == E.remote_in_end) {
+			ssize_t n = read(E.remote_fd, E.remote_in, sizeof(E.remote_in));
+			if (n == -1 && errno == EINTR) continue;
+			if (n == 0) errno = ECONNRESET;
+			if (n <= 0) die("EditorRemote: read");
+			E.remote_in_start = 0;
+			E.remote_in_end = n;
+		}
+
+		size_t chunk = E.remote_in_end - E.remote_in_start;
+		if (chunk > len) chunk = len;
+		memcpy(b, &E.remote_in[E.remote_in_start], chunk);
+		E.remote_in_start += chunk;
+		b += chunk;
+		len -= chunk;
+	}
+}
+
+void editorRemoteReadLine(char *line, size_t cap)
+{
+	size_t len = 0;
+	char c;
+	while (1)
+	{
+		editorRemoteRead(&c, 1);
+		if (c == '\n') break;
+		if (len + 1 < cap) line[len++] = c;
+	}
+	line[len] = '\0';
+}
+
+// edits of an attached buffer are forwarded as journal records, the daemon
+// applies them and logs them to its own journal
+void editorRemoteSendEdit(const char *head, const char *s, int len, uint32_t sum)
+{
+	buffer msg = BUFFER_INIT;
+	char line[32];
+	int n = snprintf(line, sizeof(line), "edit %d\n", JOURNAL_RECORD_HEADER + len + (int)sizeof(sum));
+
+	bufferAppend(&msg, line, n);
+	bufferAppend(&msg, head, JOURNAL_RECORD_HEADER);
+	if (len > 0) bufferAppend(&msg, s, len);
+	bufferAppend(&msg, (char *)&sum, sizeof(sum));
+	editorRemoteWrite(msg.b, msg.len);
+	free(msg.b);
+}
+
+// rows of an attached buffer are read from the daemon when they are first needed
+void editorRemoteFetch(int first, int count)
+{
+	if (first < 0) {
+		count += first;
+		first = 0;
+	}
+	if (count > E.line_count - first) count = E.line_count - first;
+	while (count > 0 && !editorRowMissing(&E.text[first])) {
+		first++;
+		count--;
+	}
+	while (count > 0 && !editorRowMissing(&E.text[first + count - 1])) count--;
+	if (count <= 0) return;
+
+	char line[64];
+	int n = snprintf(line, sizeof(line), "rows %d %d\n", first, count);
+	editorRemoteWrite(line, n);
+
+	editorRemoteReadLine(line, sizeof(line));
+	if (sscanf(line, "rows %d", &n) != 1 || n < 0 || n > count) {
+		errno = EPROTO;
+		die("EditorRemoteFetch");
+	}
+
+	int j;
+	for (j = first; j < first + n; j++)
+	{
+		int size;
+		editorRemoteReadLine(line, sizeof(line));
+		if (sscanf(line, "%d", &size) != 1 || size < 0) {
+			errno = EPROTO;
+			die("EditorRemoteFetch");
+		}
+
+		char *chars = malloc(size + 1);
+		if (chars == NULL) die("EditorRemoteFetch: malloc");
+		editorRemoteRead(chars, size);
+		chars[size] = '\0';
+
+		row *line = &E.text[j];
+		if (!editorRowMissing(line)) {
+			free(chars);
+			continue;
+		}
+		line->chars = chars;
+		line->size = size;
+		E.heap_bytes += size + 1;
+	}
+}
+
+void editorFillRows(int first, int count)
+{
+	if (E.remote_fd != -1)
+		editorRemoteFetch(first, count);
+	else if (E.line_index)
+		editorIndexRows(first, count);
+}
+
+// the rows around the cursor and on screen are filled in before they are drawn
+void editorPrefetchRows()
+{
+	void editorScroll();
+
+	if (E.remote_fd == -1 && E.line_index == NULL) return;
+
+	editorFillRows(E.cy - 1, 3);
+	editorScroll();
+
+	// rows hidden by folds are skipped, the ones between them fetched together
+	int y = 0;
+	while (y <= E.screenrows)
+	{
+		int first = editorFileRow(E.rowoff + y);
+		int count = 1;
+		while (y + count <= E.screenrows && editorFileRow(E.rowoff + y + count) == first + count) count++;
+		editorFillRows(first, count);
+		y += count;
+	}
+}
+
+void editorRemoteSave()
+{
+	void editorSetStatusMessage(int duration, const char *fmt, ...);
+
+	char line[128];
+	editorRemoteWrite("save\n", 5);
+	editorRemoteReadLine(line, sizeof(line));
+
+	char *msg = strchr(line, ' ');
+	if (strncmp(line, "ok", 2) == 0) E.dirty = 0;
+	editorSetStatusMessage(5, "%s", msg ? msg + 1 : line);
+}
+
+// Attaches the current buffer to the file held by the daemon. Only the line
+// count is read up front, rows are fetched as they come into view.
+int editorAttach(const char *filename)
+{
+	char *path = realpath(filename, NULL);
+	if (path == NULL) return -1;
+
+	struct sockaddr_un addr;
+	if (editorSocketAddress(&addr) == -1) {
+		free(path);
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int failed = fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1;
+	if (!failed && !socketPeerIsUs(fd)) {
+		failed = 1;
+		errno = EPERM;
+	}
+	if (failed) {
+		int saved = errno;
+		if (fd != -1) close(fd);
+		free(path);
+		errno = saved;
+		return -1;
+	}
+
+	E.remote_fd = fd;
+	buffer msg = BUFFER_INIT;
+	bufferAppend(&msg, "open ", 5);
+	bufferAppend(&msg, path, strlen(path));
+	bufferAppend(&msg, "\n", 1);
+	editorRemoteWrite(msg.b, msg.len);
+	free(msg.b);
+
+	char line[128];
+	int count, dirty;
+	editorRemoteReadLine(line, sizeof(line));
+	if (sscanf(line, "ok %d %d", &count, &dirty) != 2 || count < 0) {
+		int error;
+		close(fd);
+		E.remote_fd = -1;
+		free(path);
+		errno = sscanf(line, "err %d", &error) == 1 ? error : EPROTO;
+		return -1;
+	}
+
+	free(E.filename);
+	E.filename = path;
+	E.dirty = dirty;
+	E.disk_exact = 0;
+
+	editorReserveMissingRows(count);
+	E.line_count = count;
+
+	editorPrefetchRows();
+	return 0;
+}
+
+void diffPushHash(uint64_t **hashes, int *count, int *cap, uint64_t hash)
+{
+	if (*count == *cap) {
+		*cap = *cap ? *cap * 2 : 1024;
+		*hashes = realloc(*hashes, sizeof(uint64_t) * *cap);
+		if (*hashes == NULL) die("DiffPushHash: realloc");
+	}
+	(*hashes)[(*count)++] = hash;
+}
+
+// Hashes the buffer a chunk of rows at a time under the lock, then the file and
+// the diff itself without it. The result is dropped if the buffer changed or
+// another one was switched to in the meantime.
+void *editorDiffThread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&E.lock);
+	int current = E.current_buffer;
+	long long generation = E.generation;
+	char *filename = strdup(E.filename);
+	int count = E.line_count;
+	uint64_t *new = malloc(sizeof(uint64_t) * (count + 1));
+	uint64_t *old = NULL;
+	char *marks = NULL;
+	buffer copy = BUFFER_INIT;
+
+	int j;
+	for (j = 0; j < count; j++)
+	{
+		if (j % DIFF_CHUNK == 0 && j > 0) {
+			pthread_mutex_unlock(&E.lock);
+			pthread_mutex_lock(&E.lock);
+			if (E.current_buffer != current || E.generation != generation) goto done;
+		}
+		// spilled rows are read without being loaded back
+		editorReleaseRows(j);
+		copy.len = 0;
+		editorRowCopy(&E.text[j], &copy);
+		new[j] = lineHash(copy.b, copy.len);
+	}
+	pthread_mutex_unlock(&E.lock);
+	free(copy.b);
+	copy.b = NULL;
+
+	// The file is read rather than mapped, it may be cut short while it's hashed.
+	// Carriage returns are only hashed once something other than a newline follows.
+	int old_count = 0, old_cap = 0;
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		char *chunk = malloc(SAVE_CHUNK);
+		if (chunk == NULL) die("EditorDiffThread: malloc");
+		uint64_t hash = LINE_HASH_INIT;
+		int returns = 0, open_line = 0;
+		while (1)
+		{
+			ssize_t n = read(fd, chunk, SAVE_CHUNK);
+			if (n == -1 && errno == EINTR) continue;
+			if (n <= 0) break;
+
+			ssize_t k;
+			for (k = 0; k < n; k++)
+			{
+				if (chunk[k] == '\n') {
+					diffPushHash(&old, &old_count, &old_cap, hash);
+					hash = LINE_HASH_INIT;
+					returns = open_line = 0;
+					continue;
+				}
+				if (chunk[k] == '\r') {
+					returns++;
+				} else {
+					for (; returns > 0; returns--) hash = lineHashByte(hash, '\r');
+					hash = lineHashByte(hash, chunk[k]);
+				}
+				open_line = 1;
+			}
+		}
+		if (open_line) diffPushHash(&old, &old_count, &old_cap, hash);
+		free(chunk);
+		close(fd);
+	}
+
+	int hunk_count;
+	diffHunk *hunks = diffLines(old, old_count, new, count, &hunk_count);
+	marks = calloc(count + 1, 1);
+	int removed_lines = 0;
+	for (j = 0; j < hunk_count; j++)
+	{
+		diffHunk *h = &hunks[j];
+		if (h->o1 > h->o0) marks[h->n0] |= DIFF_REMOVED;
+		removed_lines += h->o1 - h->o0;
+		int k;
+		for (k = h->n0; k < h->n1; k++)
+			marks[k] |= DIFF_ADDED;
+	}
+	free(hunks);
+
+	// added rows next to removed lines were changed
+	int added = 0, changed = 0;
+	for (j = 0; j < count; j++)
+	{
+		if (!(marks[j] & DIFF_ADDED)) continue;
+
+		int end = j;
+		int removed = 0;
+		while (end < count && (marks[end] & DIFF_ADDED)) removed |= marks[end++] & DIFF_REMOVED;
+		removed |= marks[end] & DIFF_REMOVED;
+
+		int k;
+		for (k = j; k <= end && removed; k++)
+			marks[k] = k < end ? DIFF_CHANGED : marks[k] & ~DIFF_REMOVED;
+		if (removed) changed += end - j;
+		else added += end - j;
+		j = end;
+	}
+
+	pthread_mutex_lock(&E.lock);
+	if (E.current_buffer == current && E.generation == generation && E.diff_view) {
+		free(E.diff_marks);
+		E.diff_marks = marks;
+		E.diff_count = count;
+		E.diff_generation = generation;
+		E.diff_added = added;
+		E.diff_removed = removed_lines;
+		E.diff_changed = changed;
+		E.full_redraw = 1;
+		editorRequestFrame();
+		marks = NULL;
+	}
+
+done:
+	E.diff_running = 0;
+	pthread_mutex_unlock(&E.lock);
+	free(copy.b);
+	free(marks);
+	free(old);
+	free(new);
+	free(filename);
+	return NULL;
+}
+
+// starts a diff in the background whenever the one shown is out of date
+void editorDiffUpdate()
+{
+	if (!E.diff_view || E.diff_running || E.diff_generation == E.generation) return;
+
+	pthread_t thread;
+	E.diff_running = 1;
+	if (pthread_create(&thread, NULL, editorDiffThread, NULL) != 0) {
+		E.diff_running = 0;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+void editorToggleDiff()
+{
+	void editorSetStatusMessage(int duration, const char *fmt, ...);
+
+	if (E.client || E.filename == NULL) {
+		editorSetStatusMessage(5, "no file on disk to compare with");
+		return;
+	}
+
+	E.diff_view = !E.diff_view;
+	E.full_redraw = 1;
+	if (E.diff_view) {
+		E.diff_generation = -1;
+		editorDiffUpdate();
+	} else {
+		free(E.diff_marks);
+		E.diff_marks = NULL;
+		E.diff_count = 0;
+	}
+}
+
+void editorScroll()
+{
+	if (E.hex_view) {
+		off_t rows = E.screenrows > 0 ? E.screenrows : 1;
+		if (E.hex_cursor < E.hex_offset)
+			E.hex_offset = E.hex_cursor - E.hex_cursor % HEX_WIDTH;
+		if (E.hex_cursor >= E.hex_offset + rows * HEX_WIDTH)
+			E.hex_offset = E.hex_cursor - E.hex_cursor % HEX_WIDTH - (rows - 1) * HEX_WIDTH;
+		return;
+	}
+
+	// a fold the cursor got into is opened
+	int f = editorFoldBefore(E.cy);
+	if (f != -1 && E.cy > E.folds[f].start && E.cy <= E.folds[f].end) editorRemoveFold(f);
+
+	E.rx = 0;
+	if (E.cy < E.line_count) {
+		E.rx = editorRowCxToRx(&E.text[E.cy], E.cx);
+	}
+
+	int cy = editorVisibleRow(E.cy);
+	if (cy < E.rowoff) {
+		E.rowoff = cy;
+	}
+	if (cy >= E.rowoff + E.screenrows) {
+		E.rowoff = cy - E.screenrows + 1;
+	}
+	if (E.rx < E.coloff) {
+		E.coloff = E.rx;
+	}
+	if (E.rx >= E.coloff + E.textcols) {
 		E.coloff = E.rx - E.textcols + 1;
 	}
 }
 
-void editorDrawNumberLine(buffer *buf, int index)
+void editorDrawNumberLine(buffer *buf, int index)
+{
+	char n[16];
+	snprintf(n, sizeof(n), "%d", index + 1);
+	int padding = E.number_line_width - strlen(n) - 1;
+	while(padding--)
+		bufferAppend(buf, " ", 1);
+
+	bufferAppend(buf, n, strlen(n));
+	bufferAppend(buf, "\x1b(0\x78\x1b(B ", 8);
+}
+
+// the marks are those of the last diff, until a newer one is done
+void editorDrawDiffMark(buffer *buf, int index)
+{
+	int mark = E.diff_marks && index <= E.diff_count ? E.diff_marks[index] : 0;
+
+	if (mark & DIFF_ADDED)
+		bufferAppend(buf, "\x1b[32m+\x1b[m ", 10);
+	else if (mark & DIFF_CHANGED)
+		bufferAppend(buf, "\x1b[33m~\x1b[m ", 10);
+	else if (mark & DIFF_REMOVED)
+		bufferAppend(buf, "\x1b[31m-\x1b[m ", 10);
+	else
+		bufferAppend(buf, "  ", DIFF_GUTTER);
+}
+
+// offset, sixteen bytes in hex and the same bytes as text
+void editorDrawHexRow(buffer *buf, int y)
+{
+	off_t offset = E.hex_offset + (off_t)y * HEX_WIDTH;
+	if (offset >= (off_t)E.map_size) {
+		bufferAppend(buf, "~\x1b[K", 4);
+		return;
+	}
+
+	char line[128];
+	int len = snprintf(line, sizeof(line), "%010llx  ", (long long)offset);
+	int j;
+	for (j = 0; j < HEX_WIDTH; j++)
+	{
+		if (offset + j < (off_t)E.map_size)
+			len += snprintf(&line[len], sizeof(line) - len, "%02x ", (unsigned char)E.map[offset + j]);
+		else
+			len += snprintf(&line[len], sizeof(line) - len, "   ");
+		if (j == HEX_WIDTH / 2 - 1) line[len++] = ' ';
+	}
+	line[len++] = '|';
+	for (j = 0; j < HEX_WIDTH && offset + j < (off_t)E.map_size; j++)
+	{
+		unsigned char c = E.map[offset + j];
+		line[len++] = c >= 0x20 && c < 0x7f ? c : '.';
+	}
+	line[len++] = '|';
+
+	bufferAppend(buf, line, len < E.screencols ? len : E.screencols);
+	bufferAppend(buf, "\x1b[K", 3);
+}
+
+void editorDrawRow(buffer *buf, int y)
+{
+	if (E.hex_view) {
+		editorDrawHexRow(buf, y);
+		return;
+	}
+
+	int filerow = editorFileRow(y + E.rowoff);
+	if (filerow >= E.line_count) {
+		if (filerow == 0 && E.number_line)
+			editorDrawNumberLine(buf, filerow);
+		else
+			bufferAppend(buf, "~", 1);
+		if (filerow == E.line_count && E.diff_view)
+			editorDrawDiffMark(buf, filerow);
+	} else {
+		if (E.number_line)
+			editorDrawNumberLine(buf, filerow);
+		if (E.diff_view)
+			editorDrawDiffMark(buf, filerow);
+
+		char *render = editorRowRender(&E.text[filerow]);
+		int len = E.text[filerow].rsize - E.coloff;
+		if (len < 0) len = 0;
+		if (len > E.textcols) len = E.textcols;
+
+		// the cursors of a block are shown in reverse, on the rows reaching its column
+		int top, mark = -1;
+		int cursors = editorBlockRows(&top);
+		if (filerow >= top && filerow < top + cursors && E.block_rx <= E.text[filerow].rsize)
+			mark = E.block_rx - E.coloff;
+		if (mark >= 0 && mark < E.textcols) {
+			bufferAppend(buf, &render[E.coloff], mark);
+			bufferAppend(buf, "\x1b[7m", 4);
+			bufferAppend(buf, mark < len ? &render[E.coloff + mark] : " ", 1);
+			bufferAppend(buf, "\x1b[m", 3);
+			if (mark < len) bufferAppend(buf, &render[E.coloff + mark + 1], len - mark - 1);
+			else len++;
+		} else {
+			bufferAppend(buf, &render[E.coloff], len);
+		}
+
+		int f = editorFoldBefore(filerow);
+		if (f != -1 && E.folds[f].start == filerow && len < E.textcols) {
+			char marker[48];
+			int mlen = snprintf(marker, sizeof(marker), " +%d lines", E.folds[f].end - E.folds[f].start);
+			if (mlen > E.textcols - len) mlen = E.textcols - len;
+			bufferAppend(buf, "\x1b[2m", 4);
+			bufferAppend(buf, marker, mlen);
+			bufferAppend(buf, "\x1b[m", 3);
+		}
+	}
+
+	bufferAppend(buf, "\x1b[K", 3);
+}
+
+void editorDrawRows(buffer *buf)
+{
+	int y;
+	for (y = 0; y < E.screenrows; y++)
+	{
+		editorDrawRow(buf, y);
+		bufferAppend(buf, "\r\n", 2);
+	}
+}
+
+// Only rows that were scrolled into view or changed since the last frame are drawn.
+// Returns the number of rows drawn, -1 if the whole screen has to be.
+int editorDrawChangedRows(buffer *buf)
+{
+	int delta = E.rowoff - E.drawn_rowoff;
+	if (E.full_redraw || E.hex_view || E.coloff != E.drawn_coloff ||
+		E.screenrows != E.drawn_rows || E.screencols != E.drawn_cols ||
+		E.number_line_width != E.drawn_nl_width || abs(delta) >= E.screenrows)
+		return -1;
+
+	char seq[32];
+	if (delta != 0) {
+		snprintf(seq, sizeof(seq), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+			E.screenrows, abs(delta), delta > 0 ? 'S' : 'T');
+		bufferAppend(buf, seq, strlen(seq));
+	}
+
+	int drawn = 0;
+	int y;
+	for (y = 0; y < E.screenrows; y++)
+	{
+		int filerow = editorFileRow(y + E.rowoff);
+		int exposed = delta > 0 ? y >= E.screenrows - delta : y < -delta;
+		if (!exposed && (filerow < E.damage_lo || filerow > E.damage_hi)) continue;
+
+		snprintf(seq, sizeof(seq), "\x1b[%d;1H", y + 1);
+		bufferAppend(buf, seq, strlen(seq));
+		editorDrawRow(buf, y);
+		drawn++;
+	}
+	return drawn;
+}
+
+void editorDrawStatusBar(buffer *buf)
+{
+	bufferAppend(buf, "\x1b[7m", 4);
+	char status[80], rstatus[80];
+
+	char index[32] = "";
+	if (E.buffer_count > 1)
+		snprintf(index, sizeof(index), "[%d/%d] ", E.current_buffer + 1, E.buffer_count);
+
+	int len, rlen;
+	if (E.hex_view) {
+		len = snprintf(status, sizeof(status), " %s%.20s - %lld bytes (hex)",
+			index, E.filename, (long long)E.map_size);
+		rlen = snprintf(rstatus, sizeof(rstatus), "0x%llx/0x%llx ",
+			(long long)E.hex_cursor, (long long)E.map_size);
+	} else {
+		len = snprintf(status, sizeof(status), " %s%.20s%s - %d lines",
+			index,
+			E.filename ? E.filename : "New Buffer",
+			E.dirty ? " (modified)" : "",
+			E.line_count);
+		char diff[48] = "";
+		if (E.diff_view)
+			snprintf(diff, sizeof(diff), "+%d ~%d -%d | ", E.diff_added, E.diff_changed, E.diff_removed);
+		char block[32] = "";
+		int top, cursors = editorBlockRows(&top);
+		if (cursors)
+			snprintf(block, sizeof(block), "%d cursors | ", cursors);
+
+		rlen = snprintf(rstatus, sizeof(status), "%s%s%s%d/%d ",
+			E.macro_recording ? "recording | " : "", block, diff, E.cy + 1, E.line_count);
+	}
+
+	if (len > E.screencols) len = E.screencols;
+	bufferAppend(buf, status, len);
+
+	while (len < E.screencols)
+	{
+		if (E.screencols - len == rlen) {
+			bufferAppend(buf, rstatus, rlen);
+			break;
+		} else {
+			bufferAppend(buf, " ", 1);
+			len++;
+		}
+	}
+	bufferAppend(buf, "\x1b[m", 3);
+	bufferAppend(buf, "\r\n", 2);
+}
+
+void editorDrawMessageBar(buffer *buf)
+{
+	bufferAppend(buf, "\x1b[K", 3);
+	int msglen = strlen(E.statusmsg);
+	if (msglen > E.screencols) msglen = E.screencols;
+	if (E.duration == 0)
+		bufferAppend(buf, E.statusmsg, msglen);
+	else if (msglen && time(NULL) - E.statusmsg_time < E.duration)
+		bufferAppend(buf, E.statusmsg, msglen);
+}
+
+// builds the next frame, leaves it empty if the screen is up to date
+void editorRefreshScreen(buffer *frame)
+{
+	editorScroll();
+
+	// Escape codes only ask for the size at startup, here the answer would be read
+	// off the input by the other thread. Without a size from the kernel the last
+	// one is kept.
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+		E.screenrows = ws.ws_row - 2;
+		E.screencols = ws.ws_col;
+	}
+	E.textcols = E.screencols;
+
+	if (E.number_line) {
+		E.number_line_width = floor(log10(E.line_count + 1)) + 3;
+		if (E.number_line_width < DEFAULT_NL_WIDTH)
+			E.number_line_width = DEFAULT_NL_WIDTH;
+
+		E.textcols = E.screencols - E.number_line_width;
+	}
+	if (E.diff_view) E.textcols -= DIFF_GUTTER;
+
+	buffer b = *frame;
+	buffer bars = BUFFER_INIT;
+
+	editorDrawStatusBar(&bars);
+	editorDrawMessageBar(&bars);
+
+	char buf[32];
+	if (E.hex_view) {
+		int column = (E.hex_cursor - E.hex_offset) % HEX_WIDTH;
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+			(int)((E.hex_cursor - E.hex_offset) / HEX_WIDTH) + 1,
+			12 + column * 3 + (column >= HEX_WIDTH / 2) + 1);
+	} else {
+		snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+			editorVisibleRow(E.cy) - E.rowoff + 1,
+			E.rx - E.coloff + E.number_line_width + (E.diff_view ? DIFF_GUTTER : 0) + 1);
+	}
+	bufferAppend(&bars, buf, strlen(buf));
+
+	// frames are synchronized so the terminal never shows one half drawn
+	bufferAppend(&b, "\x1b[?2026h", 8);
+	bufferAppend(&b, "\x1b[?25l", 6);
+
+	int drawn = editorDrawChangedRows(&b);
+	if (drawn == -1) {
+		bufferAppend(&b, "\x1b[H", 3);
+		editorDrawRows(&b);
+	} else if (drawn == 0 && E.rowoff == E.drawn_rowoff && bars.len == E.drawn_bars.len &&
+		memcmp(bars.b, E.drawn_bars.b, bars.len) == 0) {
+		free(b.b);
+		free(bars.b);
+		return;
+	} else {
+		snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows + 1);
+		bufferAppend(&b, buf, strlen(buf));
+	}
+
+	bufferAppend(&b, bars.b, bars.len);
+	bufferAppend(&b, "\x1b[?25h", 6);
+	bufferAppend(&b, "\x1b[?2026l", 8);
+	*frame = b;
+
+	free(E.drawn_bars.b);
+	E.drawn_bars = bars;
+	E.drawn_rowoff = E.rowoff;
+	E.drawn_coloff = E.coloff;
+	E.drawn_rows = E.screenrows;
+	E.drawn_cols = E.screencols;
+	E.drawn_nl_width = E.number_line_width;
+	E.full_redraw = 0;
+	E.damage_lo = INT_MAX;
+	E.damage_hi = -1;
+}
+
+void editorWriteFrame(const char *b, int len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(E.output_fd, b, len);
+		if (n == -1) {
+			if (errno == EAGAIN) {
+				struct pollfd pfd = {E.output_fd, POLLOUT, 0};
+				poll(&pfd, 1, -1);
+			} else if (errno != EINTR) {
+				return;
+			}
+			continue;
+		}
+		b += n;
+		len -= n;
+	}
+}
+
+// Frames are built from whatever the state is when the previous one has been
+// written out, so edits made meanwhile are coalesced and a slow terminal only
+// ever has one frame queued.
+void *editorRenderLoop(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&E.lock);
+	while (1)
+	{
+		while (!E.frame_pending)
+			pthread_cond_wait(&E.frame_cond, &E.lock);
+		E.frame_pending = 0;
+
+		buffer frame = BUFFER_INIT;
+		editorRefreshScreen(&frame);
+		pthread_mutex_unlock(&E.lock);
+
+		pthread_mutex_lock(&E.output_lock);
+		editorWriteFrame(frame.b, frame.len);
+		pthread_mutex_unlock(&E.output_lock);
+		free(frame.b);
+
+		pthread_mutex_lock(&E.lock);
+	}
+	return NULL;
+}
+
+void editorSetStatusMessage(int duration, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+	va_end(ap);
+	E.statusmsg_time = time(NULL);
+	E.duration = duration;
+}
+
+void editorClearStatusMessage()
+{
+	E.statusmsg[0] = '\0';
+}
+
+char *editorPrompt(char *prompt)
+{
+	size_t bufsize = 128;
+	char *buf = malloc(bufsize);
+
+	size_t buflen = 0;
+	buf[0] = '\0';
+
+	while (1)
+	{
+		editorSetStatusMessage(0, prompt, buf);
+		int c = editorReadKey();
+		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+			if (buflen != 0) buf[--buflen] = '\0';
+		} else if (c == '\x1b') {
+			editorClearStatusMessage();
+			free(buf);
+			return NULL;
+		} else if (c == '\r') {
+			if (buflen != 0) {
+				editorClearStatusMessage();
+				return buf;
+			}
+		} else if (c < 128 && !iscntrl(c)) {
+			if (buflen == bufsize - 1) {
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+			}
+			buf[buflen++] = c;
+			buf[buflen] = '\0';
+		}
+	}
+}
+
+void editorSwitchBuffer(int index)
 {
-	char n[16];
-	snprintf(n, sizeof(n), "%d", index + 1);
-	int padding = E.number_line_width - strlen(n) - 1;
-	while(padding--)
-		bufferAppend(buf, " ", 1);
+	if (E.buffer_count < 2) {
+		editorSetStatusMessage(5, "no other buffers open");
+		return;
+	}
+
+	editorSwapBuffer((index + E.buffer_count) % E.buffer_count);
+	E.buffers[E.current_buffer].last_used = ++E.buffer_clock;
+	E.full_redraw = 1;
+
+	editorSetStatusMessage(5, "%s | %zu KiB cached in all buffers",
+		E.filename ? E.filename : "New Buffer", editorHeapBytes() >> 10);
+}
+
+int editorUnsavedBuffers()
+{
+	int unsaved = E.dirty ? 1 : 0;
+	int j;
+	for (j = 0; j < E.buffer_count; j++)
+		if (j != E.current_buffer && E.buffers[j].dirty) unsaved++;
+	return unsaved;
+}
+
+// an untouched new buffer is reused
+void editorNewBuffer()
+{
+	if (E.filename || E.line_count || E.dirty) {
+		E.buffers = realloc(E.buffers, sizeof(textBuffer) * (E.buffer_count + 1));
+		editorStoreBuffer(&E.buffers[E.current_buffer]);
+		E.current_buffer = E.buffer_count++;
+		editorResetBuffer();
+	}
+	E.buffers[E.current_buffer].last_used = ++E.buffer_clock;
+}
+
+void editorOpenBuffer()
+{
+	char *filename = editorPrompt("Open: %s (ESC to cancel)");
+	if (filename == NULL) return;
+
+	// attached buffers are named by their full path
+	char *path = E.client ? realpath(filename, NULL) : NULL;
+	if (path) {
+		free(filename);
+		filename = path;
+	}
+
+	int j;
+	for (j = 0; j < E.buffer_count; j++)
+	{
+		char *name = j == E.current_buffer ? E.filename : E.buffers[j].filename;
+		if (name && strcmp(name, filename) == 0) {
+			free(filename);
+			if (j != E.current_buffer) editorSwitchBuffer(j);
+			return;
+		}
+	}
+
+	if (access(filename, R_OK) == -1) {
+		editorSetStatusMessage(5, "can't open %s: %s", filename, strerror(errno));
+		free(filename);
+		return;
+	}
+
+	editorNewBuffer();
+	E.full_redraw = 1;
+
+	if (!E.client) {
+		editorOpen(filename);
+	} else if (editorAttach(filename) == -1) {
+		editorSetStatusMessage(5, "can't attach %s: %s", filename, strerror(errno));
+	}
+	free(filename);
+}
+
+// counts the words of the rows not yet in the index, a chunk at a time
+void *editorWordsThread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&E.lock);
+	int current = E.current_buffer;
+	while (E.current_buffer == current && !E.words_dropped && E.word_scanned < E.line_count)
+	{
+		int end = E.word_scanned + WORD_CHUNK;
+		if (end > E.line_count) end = E.line_count;
+		for (; E.word_scanned < end; E.word_scanned++)
+		{
+			editorReleaseRows(E.word_scanned);
+			row *line = &E.text[E.word_scanned];
+			editorWordsInSpan(line, 0, line->size, 1);
+		}
+		editorWordsCheckLimit();
+		pthread_mutex_unlock(&E.lock);
+		pthread_mutex_lock(&E.lock);
+	}
+	E.words_running = 0;
+	pthread_mutex_unlock(&E.lock);
+	return NULL;
+}
+
+// the rows of an attached buffer would all have to be fetched from the daemon
+void editorWordsUpdate()
+{
+	if (E.words_running || E.words_dropped || E.word_scanned >= E.line_count || E.remote_fd != -1) return;
+
+	pthread_t thread;
+	E.words_running = 1;
+	if (pthread_create(&thread, NULL, editorWordsThread, NULL) != 0) {
+		E.words_running = 0;
+		return;
+	}
+	pthread_detach(thread);
+}
+
+typedef struct
+{
+	int bound;
+	int node;
+	int word;
+} wordCandidate;
+
+void wordHeapPush(wordCandidate *heap, int *len, wordCandidate item)
+{
+	int j = (*len)++;
+	while (j > 0 && heap[(j - 1) / 2].bound < item.bound)
+	{
+		heap[j] = heap[(j - 1) / 2];
+		j = (j - 1) / 2;
+	}
+	heap[j] = item;
+}
+
+wordCandidate wordHeapPop(wordCandidate *heap, int *len)
+{
+	wordCandidate top = heap[0];
+	wordCandidate last = heap[--(*len)];
+	int j = 0;
+	while (2 * j + 1 < *len)
+	{
+		int child = 2 * j + 1;
+		if (child + 1 < *len && heap[child + 1].bound > heap[child].bound) child++;
+		if (heap[child].bound <= last.bound) break;
+		heap[j] = heap[child];
+		j = child;
+	}
+	heap[j] = last;
+	return top;
+}
+
+// Best first search below the prefix: a subtree is opened in the order of its total,
+// and a word taken once no subtree left could hold a more frequent one.
+int editorWordsComplete(const char *prefix, int len, char **choices, int max)
+{
+	if (E.words == NULL) return 0;
+
+	int node = 0;
+	int j;
+	for (j = 0; j < len && node != -1; j++)
+		node = editorWordChild(node, prefix[j], 0);
+	if (node == -1 || E.words[node].total == 0) return 0;
+
+	int cap = 256, heaplen = 0, found = 0, steps = 0;
+	wordCandidate *heap = malloc(sizeof(wordCandidate) * cap);
+	wordCandidate start = {E.words[node].total, node, 0};
+	wordHeapPush(heap, &heaplen, start);
+
+	while (heaplen > 0 && found < max && steps++ < WORD_SEARCH_MAX)
+	{
+		wordCandidate item = wordHeapPop(heap, &heaplen);
+		if (item.word) {
+			int depth = 0, k;
+			for (k = item.node; k != 0; k = E.words[k].parent) depth++;
+			char *word = malloc(depth + 1);
+			word[depth] = '\0';
+			for (k = item.node; k != 0; k = E.words[k].parent) word[--depth] = E.words[k].c;
+			choices[found++] = word;
+			continue;
+		}
+
+		wordNode *n = &E.words[item.node];
+		int children = 0, child;
+		for (child = n->child; child != -1; child = E.words[child].next) children++;
+		if (heaplen + children + 1 > cap) {
+			while (heaplen + children + 1 > cap) cap *= 2;
+			heap = realloc(heap, sizeof(wordCandidate) * cap);
+		}
+
+		// the prefix itself is what was typed
+		if (n->count > 0 && item.node != node) {
+			wordCandidate word = {n->count, item.node, 1};
+			wordHeapPush(heap, &heaplen, word);
+		}
+		for (child = n->child; child != -1; child = E.words[child].next)
+		{
+			if (E.words[child].total <= 0) continue;
+			wordCandidate next = {E.words[child].total, child, 0};
+			wordHeapPush(heap, &heaplen, next);
+		}
+	}
+	free(heap);
+	return found;
+}
+
+void editorClearCompletion()
+{
+	int j;
+	for (j = 0; j < E.complete_count; j++)
+		free(E.complete_choices[j]);
+	E.complete_count = 0;
+}
+
+// Completes the word before the cursor with the most frequent word of the buffer
+// starting with it. Asking again right away replaces it with the next one.
+void editorComplete()
+{
+	if (E.cy >= E.line_count) return;
+	row *line = &E.text[E.cy];
+	char *chars = editorRowChars(line);
+
+	int again = E.complete_count > 0 && E.complete_generation == E.generation &&
+		E.complete_buffer == E.current_buffer && E.complete_row == E.cy;
+	if (again) {
+		while (E.cx > E.complete_at + E.complete_len)
+			editorRowDelChar(line, --E.cx);
+		E.complete_index = (E.complete_index + 1) % E.complete_count;
+	} else {
+		editorClearCompletion();
+		if (E.words_dropped) {
+			editorSetStatusMessage(3, "the words of this buffer don't fit in memlimit");
+			return;
+		}
+
+		// only the end of a word is completed, the rest of it would complete itself
+		int start = E.cx;
+		while (start > 0 && isWordChar(chars[start - 1])) start--;
+		if (start == E.cx || (E.cx < line->size && isWordChar(chars[E.cx]))) {
+			editorSetStatusMessage(3, "nothing to complete");
+			return;
+		}
+
+		E.complete_count = editorWordsComplete(&chars[start], E.cx - start, E.complete_choices, WORD_CHOICES);
+		if (E.complete_count == 0) {
+			editorSetStatusMessage(3, "no completions for %.*s%s", E.cx - start, &chars[start],
+				E.word_scanned < E.line_count ? " (still indexing)" : "");
+			return;
+		}
+		E.complete_buffer = E.current_buffer;
+		E.complete_row = E.cy;
+		E.complete_at = start;
+		E.complete_len = E.cx - start;
+		E.complete_index = 0;
+	}
+
+	char *choice = E.complete_choices[E.complete_index];
+	int j;
+	for (j = E.complete_len; choice[j]; j++)
+		editorRowInsertChar(line, E.cx++, choice[j]);
+	E.complete_generation = E.generation;
+
+	if (E.complete_count > 1)
+		editorSetStatusMessage(3, "%d/%d, Ctrl+T again for the next", E.complete_index + 1, E.complete_count);
+}
+
+int editorWorkerCount(int count)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count < PARALLEL_MIN_ROWS || cpus < 2) return 1;
+	if (cpus > PARALLEL_MAX_THREADS) cpus = PARALLEL_MAX_THREADS;
+	if (cpus > count / PARALLEL_MIN_ROWS) cpus = count / PARALLEL_MIN_ROWS;
+	return cpus;
+}
+
+// The rows are read by worker threads, which must not page anything in.
+void editorLoadRows(int at, int count)
+{
+	editorIndexRelease();
+
+	int j;
+	for (j = at; j < at + count; j++)
+	{
+		editorReleaseRows(j);
+		editorRowChars(&E.text[j]);
+	}
+}
+
+typedef struct
+{
+	// the first bytes of the line, big endian, so most comparisons don't touch the text
+	uint64_t key;
+	row *line;
+	int index;
+} sortItem;
+
+int sortCompare(const sortItem *a, const sortItem *b)
+{
+	if (a->key != b->key) return a->key < b->key ? -1 : 1;
+
+	int len = a->line->size < b->line->size ? a->line->size : b->line->size;
+	int c = memcmp(a->line->chars, b->line->chars, len);
+	if (c != 0) return c;
+	return a->line->size - b->line->size;
+}
+
+// gives back the scratch a merge has moved past, a few pages at a time
+void sortRelease(sortItem *items, int *released, int at)
+{
+	if (at - *released < RELEASE_ROWS / 16) return;
+	editorScratchDrop(&items[*released], sizeof(sortItem) * (at - *released));
+	*released = at;
+}
+
+// Merges the sorted runs items[lo..mid) and items[mid..hi) through tmp, stable. Under
+// memlimit long merges go a block at a time and give back what they have passed.
+void sortMerge(sortItem *items, sortItem *tmp, int lo, int mid, int hi)
+{
+	int release = E.mem_limit && hi - lo > RELEASE_ROWS;
+	// a block reads the text of at most this many rows, so it can only fault in so many pages
+	int block = release ? RELEASE_ROWS / 16 : hi - lo;
+	int i = lo, j = mid, k = lo;
+	int released_i = lo, released_j = mid, released_k = lo;
+	while (k < hi)
+	{
+		int end = hi - k < block ? hi : k + block;
+		while (k < end && i < mid && j < hi)
+			tmp[k++] = sortCompare(&items[j], &items[i]) < 0 ? items[j++] : items[i++];
+		while (k < end && i < mid) tmp[k++] = items[i++];
+		while (k < end && j < hi) tmp[k++] = items[j++];
+		if (!release) continue;
+
+		sortRelease(items, &released_i, i);
+		sortRelease(items, &released_j, j);
+		sortRelease(tmp, &released_k, k);
+		// the comparisons read the text wherever the keys are alike
+		if (editorResidentBytes() > E.mem_limit) editorDropBufferPages();
+	}
+
+	for (k = lo; k < hi; k += RELEASE_ROWS)
+	{
+		int n = hi - k < RELEASE_ROWS ? hi - k : RELEASE_ROWS;
+		memcpy(&items[k], &tmp[k], sizeof(sortItem) * n);
+		if (release) {
+			editorScratchDrop(&items[k], sizeof(sortItem) * n);
+			editorScratchDrop(&tmp[k], sizeof(sortItem) * n);
+		}
+	}
+}
+
+void sortRange(sortItem *items, sortItem *tmp, int lo, int hi)
+{
+	if (hi - lo <= 16) {
+		int j;
+		for (j = lo + 1; j < hi; j++)
+		{
+			sortItem item = items[j];
+			int k = j;
+			while (k > lo && sortCompare(&item, &items[k - 1]) < 0) {
+				items[k] = items[k - 1];
+				k--;
+			}
+			items[k] = item;
+		}
+		return;
+	}
+
+	int mid = lo + (hi - lo) / 2;
+	sortRange(items, tmp, lo, mid);
+	sortRange(items, tmp, mid, hi);
+	if (sortCompare(&items[mid], &items[mid - 1]) < 0) sortMerge(items, tmp, lo, mid, hi);
+	// the text read by the comparisons is given back every few thousand rows
+	if (E.mem_limit && hi - lo >= RELEASE_ROWS / 16 && editorResidentBytes() > E.mem_limit) editorDropBufferPages();
+}
+
+typedef struct
+{
+	sortItem *items, *tmp;
+	int lo, mid, hi;
+} sortTask;
+
+// sorts a slice when mid is lo, otherwise merges two sorted neighbours
+void *sortWorker(void *arg)
+{
+	sortTask *task = arg;
+	if (task->mid == task->lo)
+		sortRange(task->items, task->tmp, task->lo, task->hi);
+	else
+		sortMerge(task->items, task->tmp, task->lo, task->mid, task->hi);
+	return NULL;
+}
+
+void sortRun(sortTask *tasks, int count)
+{
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	int j;
+	for (j = 1; j < count; j++)
+		if (pthread_create(&threads[j], NULL, sortWorker, &tasks[j]) != 0) die("SortRun: pthread_create");
+	sortWorker(&tasks[0]);
+	for (j = 1; j < count; j++)
+		pthread_join(threads[j], NULL);
+}
+
+// Parallel merge sort over pointers to the rows: every worker sorts a slice, then
+// neighbouring slices are merged pairwise, also in parallel, until one is left.
+void editorSortRows(int at, int count)
+{
+	editorLoadRows(at, count);
+
+	sortItem *items = editorScratchAlloc(sizeof(sortItem) * count);
+	sortItem *tmp = editorScratchAlloc(sizeof(sortItem) * count);
+	if (items == NULL || tmp == NULL) die("EditorSortRows: editorScratchAlloc");
+
+	int j;
+	for (j = 0; j < count; j++)
+	{
+		if (j > 0 && j % RELEASE_ROWS == 0) {
+			editorScratchDrop(&items[j - RELEASE_ROWS], sizeof(sortItem) * RELEASE_ROWS);
+			if (E.mem_limit && editorResidentBytes() > E.mem_limit) editorDropBufferPages();
+		}
+		editorReleaseRows(at + j);
+		row *line = &E.text[at + j];
+		unsigned char prefix[8] = {0};
+		memcpy(prefix, line->chars, line->size < 8 ? line->size : 8);
+
+		items[j].key = 0;
+		int k;
+		for (k = 0; k < 8; k++)
+			items[j].key = items[j].key << 8 | prefix[k];
+		items[j].line = line;
+		items[j].index = j;
+	}
+
+	int workers = editorWorkerCount(count);
+	int bounds[PARALLEL_MAX_THREADS + 1];
+	sortTask tasks[PARALLEL_MAX_THREADS];
+	for (j = 0; j <= workers; j++)
+		bounds[j] = (long long)count * j / workers;
+	for (j = 0; j < workers; j++)
+	{
+		tasks[j].items = items;
+		tasks[j].tmp = tmp;
+		tasks[j].lo = tasks[j].mid = bounds[j];
+		tasks[j].hi = bounds[j + 1];
+	}
+	sortRun(tasks, workers);
+
+	while (workers > 1)
+	{
+		int merges = workers / 2;
+		for (j = 0; j < merges; j++)
+		{
+			tasks[j].lo = bounds[2 * j];
+			tasks[j].mid = bounds[2 * j + 1];
+			tasks[j].hi = bounds[2 * j + 2];
+		}
+		sortRun(tasks, merges);
+
+		// an odd run out keeps its place for the next round
+		int runs = (workers + 1) / 2;
+		for (j = 0; j <= runs; j++)
+			bounds[j] = bounds[j * 2 < workers ? j * 2 : workers];
+		workers = runs;
+	}
+	editorScratchFree(tmp, sizeof(sortItem) * count);
+
+	int32_t *order = editorScratchAlloc(sizeof(int32_t) * count);
+	if (order == NULL) die("EditorSortRows: editorScratchAlloc");
+	for (j = 0; j < count; j++)
+	{
+		if (j > 0 && j % RELEASE_ROWS == 0) {
+			editorScratchDrop(&items[j - RELEASE_ROWS], sizeof(sortItem) * RELEASE_ROWS);
+			editorScratchDrop(&order[j - RELEASE_ROWS], sizeof(int32_t) * RELEASE_ROWS);
+		}
+		order[j] = items[j].index;
+	}
+	editorScratchFree(items, sizeof(sortItem) * count);
+
+	editorPermuteRows(at, count, order);
+	editorScratchFree(order, sizeof(int32_t) * count);
+}
+
+typedef struct
+{
+	const char *pattern;
+	row *rows;
+	unsigned char *keep;
+	int lo, hi;
+	int invert;
+	int error;
+} filterTask;
+
+// Every worker compiles its own copy of the pattern so they don't share a matcher.
+// Slices start at a multiple of eight rows, workers never write the same byte.
+void *filterWorker(void *arg)
+{
+	filterTask *task = arg;
+	regex_t re;
+	if ((task->error = regcomp(&re, task->pattern, REG_EXTENDED | REG_NOSUB)) != 0) return NULL;
+
+	int j;
+	for (j = task->lo; j < task->hi; j++)
+	{
+		// mapped rows aren't terminated, the match is bounded by the row size instead
+		regmatch_t match;
+		match.rm_so = 0;
+		match.rm_eo = task->rows[j].size;
+		const char *chars = task->rows[j].chars ? task->rows[j].chars : "";
+		int found = regexec(&re, chars, 1, &match, REG_STARTEND) == 0;
+		if (found != task->invert) task->keep[j >> 3] |= 1 << (j & 7);
+	}
+	regfree(&re);
+	return NULL;
+}
+
+// keeps or drops the rows matching an extended regular expression
+int editorFilterRows(int at, int count, const char *pattern, int drop)
+{
+	editorLoadRows(at, count);
+
+	unsigned char *keep = calloc((count + 7) / 8, 1);
+	int workers = editorWorkerCount(count);
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	filterTask tasks[PARALLEL_MAX_THREADS];
+	int j;
+	for (j = 0; j < workers; j++)
+	{
+		tasks[j].pattern = pattern;
+		tasks[j].rows = &E.text[at];
+		tasks[j].keep = keep;
+		tasks[j].lo = (long long)count * j / workers & ~7;
+		tasks[j].hi = j + 1 < workers ? ((long long)count * (j + 1) / workers & ~7) : count;
+		tasks[j].invert = drop;
+		if (j > 0 && pthread_create(&threads[j], NULL, filterWorker, &tasks[j]) != 0)
+			die("EditorFilterRows: pthread_create");
+	}
+	filterWorker(&tasks[0]);
+	for (j = 1; j < workers; j++)
+		pthread_join(threads[j], NULL);
+
+	int error = tasks[0].error;
+	if (error == 0) editorSelectRows(at, count, keep);
+	free(keep);
+	return error;
+}
+
+// drops rows that repeat the one before them
+void editorUniqRows(int at, int count)
+{
+	editorLoadRows(at, count);
+
+	unsigned char *keep = calloc((count + 7) / 8, 1);
+	int j;
+	for (j = 0; j < count; j++)
+	{
+		row *line = &E.text[at + j];
+		if (j > 0 && line->size == line[-1].size && memcmp(line->chars, line[-1].chars, line->size) == 0)
+			continue;
+		keep[j >> 3] |= 1 << (j & 7);
+	}
+	editorSelectRows(at, count, keep);
+	free(keep);
+}
+
+// Pipes the rows at..at+count through a shell command. Rows are written to it a
+// chunk at a time while its output is read back and inserted after them, so neither
+// side waits on the other and the range is never held in memory at once. When the
+// command succeeds the old rows are dropped, otherwise its output is. Returns the
+// exit status, 128 and up when it was killed by a signal or ESC, or -1 with errno set.
+int editorPipeRows(int at, int count, const char *command, int *produced)
+{
+	void editorDropBufferPages();
+
+	int in[2], out[2];
+	*produced = 0;
+	if (pipe2(in, O_CLOEXEC) == -1) return -1;
+	if (pipe2(out, O_CLOEXEC) == -1) {
+		close(in[0]);
+		close(in[1]);
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		// in a group of its own, so cancelling reaches everything the shell started
+		setpgid(0, 0);
+
+		// the command's errors would land on the screen
+		int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		if (null != -1) dup2(null, STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	if (pid == -1) {
+		close(in[1]);
+		close(out[0]);
+		return -1;
+	}
+
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	fcntl(out[0], F_SETFL, O_NONBLOCK);
+	struct sigaction ignore, old;
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ignore, &old);
+
+	buffer input = BUFFER_INIT, output = BUFFER_INIT;
+	int written = 0;
+	int next = at;
+	int writing = 1, reading = 1, killed = 0;
+	setpgid(pid, pid);
+	char chunk[SAVE_CHUNK];
+
+	while (reading)
+	{
+		struct pollfd fds[3] = {
+			{out[0], POLLIN, 0},
+			{STDIN_FILENO, POLLIN, 0},
+			{writing ? in[1] : -1, POLLOUT, 0}
+		};
+		if (poll(fds, 3, -1) == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		if ((fds[1].revents & POLLIN) && editorPollCancel()) {
+			kill(-pid, SIGTERM);
+			killed = 1;
+			break;
+		}
+
+		if (fds[2].revents & (POLLOUT | POLLERR | POLLHUP)) {
+			if (written == input.len) {
+				input.len = written = 0;
+				while (next < at + count && input.len < SAVE_CHUNK)
+				{
+					editorReleaseRows(next);
+					editorRowCopy(&E.text[next++], &input);
+					bufferAppend(&input, "\n", 1);
+				}
+			}
+
+			ssize_t n = input.len ? write(in[1], &input.b[written], input.len - written) : 0;
+			if (n > 0) written += n;
+			if ((n == -1 && errno != EAGAIN && errno != EINTR) || (written == input.len && next == at + count)) {
+				// the command stopped reading or has all of it
+				close(in[1]);
+				writing = 0;
+			}
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t n = read(out[0], chunk, sizeof(chunk));
+			if (n > 0) bufferAppend(&output, chunk, n);
+			if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) reading = 0;
+
+			// whole lines go in, the rest waits for more output
+			int len = output.len;
+			if (reading) {
+				while (len > 0 && output.b[len - 1] != '\n') len--;
+				if (output.len < PIPE_CHUNK) len = 0;
+			}
+			if (len > 0) {
+				int before = E.line_count;
+				editorInsertRows(at + count + *produced, output.b, len);
+				int inserted = E.line_count - before;
+
+				if (E.mem_limit && E.heap_bytes > E.mem_limit / 4) {
+					int j;
+					for (j = at + count + *produced; j < at + count + *produced + inserted; j++)
+						editorRowSpill(&E.text[j]);
+				}
+				*produced += inserted;
+
+				memmove(output.b, &output.b[len], output.len - len);
+				output.len -= len;
+			}
+		}
+
+		if (E.mem_limit && editorResidentBytes() > E.mem_limit) editorDropBufferPages();
+	}
+	if (writing) close(in[1]);
+	close(out[0]);
+	free(input.b);
+	free(output.b);
+	sigaction(SIGPIPE, &old, NULL);
+
+	int status;
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR) return -1;
+	if (killed) return 128 + SIGTERM;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// replaces lines at..at+count with the output of a command, or keeps them when it fails
+void editorFilterCommand(int at, int count, const char *command)
+{
+	long long start = monotonicMillis();
+	int produced;
+	int status = editorPipeRows(at, count, command, &produced);
+
+	if (status == -1) {
+		editorSetStatusMessage(5, "can't run %s: %s", command, strerror(errno));
+		return;
+	}
+
+	int total = count + produced;
+	if (total > 0) {
+		unsigned char *keep = calloc((total + 7) / 8, 1);
+		int j;
+		for (j = status == 0 ? count : 0; j < (status == 0 ? total : count); j++)
+			keep[j >> 3] |= 1 << (j & 7);
+		editorSelectRows(at, total, keep);
+		free(keep);
+	}
+
+	if (status == 0)
+		editorSetStatusMessage(5, "%d lines replaced by %d in %lld ms", count, produced, monotonicMillis() - start);
+	else
+		editorSetStatusMessage(5, "%s failed (exit %d), lines kept", command, status);
+}
+
+int editorRowIndent(row *line, int *blank)
+{
+	char *chars = editorRowChars(line);
+	int indent = 0;
+	int j;
+	for (j = 0; j < line->size && (chars[j] == ' ' || chars[j] == '\t'); j++)
+		indent = chars[j] == '\t' ? indent + E.tab_stop - indent % E.tab_stop : indent + 1;
+	*blank = j == line->size;
+	return indent;
+}
+
+// compares two rows as if every run of digits in them was the same
+int editorRowsAlike(row *a, row *b)
+{
+	char *p = editorRowChars(a), *end = p + a->size;
+	char *q = editorRowChars(b), *qend = q + b->size;
+	while (p < end && q < qend)
+	{
+		if (isdigit((unsigned char)*p) && isdigit((unsigned char)*q)) {
+			while (p < end && isdigit((unsigned char)*p)) p++;
+			while (q < qend && isdigit((unsigned char)*q)) q++;
+		} else if (*p++ != *q++) {
+			return 0;
+		}
+	}
+	return p == end && q == qend;
+}
+
+// Folds the block under the cursor row: the rows indented deeper than it, or
+// else the rows after it that only differ from it in their numbers, like the
+// lines of a log. On a folded row the fold is opened again.
+void editorToggleFold()
+{
+	if (E.cy >= E.line_count) return;
+
+	int f = editorFoldBefore(E.cy);
+	if (f != -1 && E.folds[f].start == E.cy) {
+		editorRemoveFold(f);
+		return;
+	}
+
+	int blank;
+	int indent = editorRowIndent(&E.text[E.cy], &blank);
+	int end = E.cy;
+	int j;
+	for (j = E.cy + 1; j < E.line_count && !blank; j++)
+	{
+		int empty;
+		int deeper = editorRowIndent(&E.text[j], &empty) > indent;
+		if (!empty && !deeper) break;
+		if (!empty) end = j;
+	}
+	if (end == E.cy)
+		while (end + 1 < E.line_count && editorRowsAlike(&E.text[E.cy], &E.text[end + 1])) end++;
 
-	bufferAppend(buf, n, strlen(n));
-	bufferAppend(buf, "\x1b(0\x78\x1b(B ", 8);
+	if (end == E.cy) {
+		editorSetStatusMessage(3, "nothing to fold below this line");
+		return;
+	}
+	editorFoldsClear(E.cy, end - E.cy + 1);
+	editorAddFold(E.cy, end);
+	editorSetStatusMessage(3, "folded %d lines", end - E.cy);
 }
 
-void editorDrawRows(buffer *buf)
+// Commands work on the whole buffer or on the lines a to b given as "a,b ".
+void editorLineCommand()
 {
-	int y;
-	for (y = 0; y < E.screenrows; y++)
-	{
-		int filerow = y + E.rowoff;
-		if (filerow >= E.line_count) {
-			if (filerow == 0 && E.number_line)
-				editorDrawNumberLine(buf, filerow);
-			else
-				bufferAppend(buf, "~", 1);
-		} else {
-			if (E.number_line)
-				editorDrawNumberLine(buf, filerow);
+	if (E.client) {
+		editorSetStatusMessage(5, "line commands aren't available on attached buffers");
+		return;
+	}
+
+	char *command = editorPrompt("Command: %s (sort, uniq, keep/drop <regex>, !shell, fold, unfold, block; a,b for lines a to b)");
+	if (command == NULL) return;
 
-			int len = E.text[filerow].rsize - E.coloff;
-			if (len < 0) len = 0;
-			if (len > E.textcols) len = E.textcols;
-			bufferAppend(buf, &E.text[filerow].render[E.coloff], len);
+	int at = 0, count = E.line_count;
+	int first, last, len;
+	char *p = command;
+	if (sscanf(p, "%d,%d%n", &first, &last, &len) == 2) {
+		if (first < 1 || last < first || first > E.line_count) {
+			editorSetStatusMessage(5, "no lines %d to %d", first, last);
+			free(command);
+			return;
 		}
+		if (last > E.line_count) last = E.line_count;
+		at = first - 1;
+		count = last - at;
+		p += len;
+	}
+	while (*p == ' ') p++;
 
-		bufferAppend(buf, "\x1b[K", 3);
-		bufferAppend(buf, "\r\n", 2);
+	long long start = monotonicMillis();
+	int before = E.line_count;
+	if (*p == '!') {
+		editorFilterCommand(at, count, &p[1]);
+	} else if (count == 0) {
+		editorSetStatusMessage(5, "no lines to work on");
+	} else if (strcmp(p, "sort") == 0) {
+		editorSortRows(at, count);
+		editorSetStatusMessage(5, "sorted %d lines in %lld ms", count, monotonicMillis() - start);
+	} else if (strcmp(p, "fold") == 0) {
+		editorFoldsClear(at, count);
+		editorAddFold(at, at + count - 1);
+		if (E.cy > at && E.cy < at + count) E.cy = at;
+		editorSetStatusMessage(5, "folded %d lines", count - 1);
+	} else if (strcmp(p, "block") == 0) {
+		E.block_rx = E.cy < E.line_count ? editorRowCxToRx(&E.text[E.cy], E.cx) : 0;
+		E.block_anchor = at;
+		E.cy = at + count - 1;
+		int cx = editorRowRxToCx(&E.text[E.cy], E.block_rx);
+		E.cx = cx == -1 ? E.text[E.cy].size : cx;
+		E.full_redraw = 1;
+		editorSetStatusMessage(5, "%d cursors, Ctrl+B to leave them", count);
+	} else if (strcmp(p, "unfold") == 0) {
+		int folds = E.fold_count;
+		editorFoldsClear(at, count);
+		editorSetStatusMessage(5, "opened %d folds", folds - E.fold_count);
+	} else if (strcmp(p, "uniq") == 0) {
+		editorUniqRows(at, count);
+		editorSetStatusMessage(5, "removed %d repeated lines", before - E.line_count);
+	} else if (strncmp(p, "keep ", 5) == 0 || strncmp(p, "drop ", 5) == 0) {
+		int error = editorFilterRows(at, count, &p[5], p[0] == 'd');
+		if (error) {
+			char message[64];
+			regerror(error, NULL, message, sizeof(message));
+			editorSetStatusMessage(5, "bad pattern: %s", message);
+		} else {
+			editorSetStatusMessage(5, "removed %d of %d lines in %lld ms",
+				before - E.line_count, count, monotonicMillis() - start);
+		}
+	} else {
+		editorSetStatusMessage(5, "unknown command: %s", p);
+	}
+	free(command);
+
+	if (E.cy > E.line_count) E.cy = E.line_count;
+	int rowlen = 0;
+	if (E.cy < E.line_count) {
+		editorRowChars(&E.text[E.cy]);
+		rowlen = E.text[E.cy].size;
 	}
+	if (E.cx > rowlen) E.cx = rowlen;
 }
 
-void editorDrawStatusBar(buffer *buf)
+// Finds the pattern by comparing its first and last byte at sixteen positions at
+// once, only where both match is the rest compared.
+const char *hexFind(const char *p, size_t len, const char *pattern, size_t n)
 {
-	bufferAppend(buf, "\x1b[7m", 4);
-	char status[80], rstatus[80];
-
-	int len = snprintf(status, sizeof(status), " %.20s%s - %d lines",
-		E.filename ? E.filename : "New Buffer",
-		E.dirty ? " (modified)" : "",
-		E.line_count);
-	int rlen = snprintf(rstatus, sizeof(status), "%d/%d ",
-		E.cy + 1, E.line_count);
+	if (n == 0 || n > len) return NULL;
 
-	if (len > E.screencols) len = E.screencols;
-	bufferAppend(buf, status, len);
-
-	while (len < E.screencols)
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i first = _mm_set1_epi8(pattern[0]);
+	__m128i last = _mm_set1_epi8(pattern[n - 1]);
+	for (; i + n - 1 + 16 <= len; i += 16)
 	{
-		if (E.screencols - len == rlen) {
-			bufferAppend(buf, rstatus, rlen);
-			break;
-		} else {
-			bufferAppend(buf, " ", 1);
-			len++;
+		__m128i a = _mm_loadu_si128((const __m128i *)&p[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&p[i + n - 1]);
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while (mask)
+		{
+			int bit = __builtin_ctz(mask);
+			if (memcmp(&p[i + bit], pattern, n) == 0) return &p[i + bit];
+			mask &= mask - 1;
 		}
 	}
-	bufferAppend(buf, "\x1b[m", 3);
-	bufferAppend(buf, "\r\n", 2);
+#endif
+	while (i + n <= len)
+	{
+		const char *c = memchr(&p[i], pattern[0], len - n + 1 - i);
+		if (c == NULL) return NULL;
+		if (memcmp(c, pattern, n) == 0) return c;
+		i = c - p + 1;
+	}
+	return NULL;
 }
 
-void editorDrawMessageBar(buffer *buf)
+// "text" in quotes, otherwise pairs of hex digits with spaces anywhere between them
+int hexParsePattern(const char *s, char *out)
 {
-	bufferAppend(buf, "\x1b[K", 3);
-	int msglen = strlen(E.statusmsg);
-	if (msglen > E.screencols) msglen = E.screencols;
-	if (E.duration == 0)
-		bufferAppend(buf, E.statusmsg, msglen);
-	else if (msglen && time(NULL) - E.statusmsg_time < E.duration)
-		bufferAppend(buf, E.statusmsg, msglen);
+	int len = 0;
+	if (s[0] == '"') {
+		const char *end = strrchr(s + 1, '"');
+		if (end == NULL) end = s + strlen(s);
+		memcpy(out, s + 1, end - s - 1);
+		return end - s - 1;
+	}
+
+	while (*s)
+	{
+		if (*s == ' ') {
+			s++;
+			continue;
+		}
+		if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1])) return -1;
+		char pair[3] = {s[0], s[1], '\0'};
+		out[len++] = strtol(pair, NULL, 16);
+		s += 2;
+	}
+	return len;
 }
 
-void editorRefreshScreen()
+void editorHexFind()
 {
-	editorScroll();
-	if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("EditorRefreshScreen: getWindowSize");
-	E.screenrows -= 2;
-	E.textcols = E.screencols;
+	void editorDropBufferPages();
 
-	if (E.number_line) {
-		E.number_line_width = floor(log10(E.line_count + 1)) + 3;
-		if (E.number_line_width < DEFAULT_NL_WIDTH)
-			E.number_line_width = DEFAULT_NL_WIDTH;
+	char *query = editorPrompt("Find bytes: %s (hex like 7f 45 4c 46, or \"text\")");
+	if (query == NULL) return;
 
-		E.textcols = E.screencols - E.number_line_width;
+	char *pattern = malloc(strlen(query) + 1);
+	int n = hexParsePattern(query, pattern);
+	free(query);
+	if (n <= 0) {
+		editorSetStatusMessage(5, "give the bytes as pairs of hex digits or as \"text\"");
+		free(pattern);
+		return;
 	}
 
-	buffer b = BUFFER_INIT;
-
-	bufferAppend(&b, "\x1b[?25l", 6);
-	bufferAppend(&b, "\x1b[H", 3);
-
-	editorDrawRows(&b);
-	editorDrawStatusBar(&b);
-	editorDrawMessageBar(&b);
+	long long start = monotonicMillis();
+	off_t from = E.hex_cursor + 1 < (off_t)E.map_size ? E.hex_cursor + 1 : 0;
+	const char *found = hexFind(&E.map[from], E.map_size - from, pattern, n);
+	int wrapped = 0;
+	if (found == NULL && from > 0) {
+		size_t end = (size_t)from - 1 + n < E.map_size ? (size_t)from - 1 + n : E.map_size;
+		found = hexFind(E.map, end, pattern, n);
+		wrapped = 1;
+	}
+	free(pattern);
+	if (E.mem_limit && editorResidentBytes() > E.mem_limit) editorDropBufferPages();
 
-	char buf[32];
-	snprintf(buf, sizeof(buf),"\x1b[%d;%dH",
-		E.cy - E.rowoff + 1,
-		E.rx - E.coloff + E.number_line_width + 1);
-	bufferAppend(&b, buf, strlen(buf));
+	if (found == NULL) {
+		editorSetStatusMessage(5, "not found");
+		return;
+	}
+	E.hex_cursor = found - E.map;
+	editorSetStatusMessage(5, "found at 0x%llx in %lld ms%s", (long long)E.hex_cursor,
+		monotonicMillis() - start, wrapped ? ", search wrapped" : "");
+}
 
-	bufferAppend(&b, "\x1b[?25h", 6);
+void editorHexGoto()
+{
+	char *answer = editorPrompt("Go to offset: %s (0x for hex)");
+	if (answer == NULL) return;
 
-	write(STDOUT_FILENO, b.b, b.len);
-	free(b.b);
+	char *end;
+	int hex = answer[0] == '0' && (answer[1] == 'x' || answer[1] == 'X');
+	unsigned long long offset = strtoull(answer, &end, hex ? 16 : 10);
+	if (*end != '\0' || E.map_size == 0) {
+		editorSetStatusMessage(5, "not an offset: %s", answer);
+		free(answer);
+		return;
+	}
+	free(answer);
+	E.hex_cursor = offset < E.map_size ? (off_t)offset : (off_t)E.map_size - 1;
 }
 
-void editorSetStatusMessage(int duration, const char *fmt, ...)
+// Switches between the hex view and the text. The rows of a binary file are read
+// when it's first shown as text, the cursor keeps to the same byte when it can.
+void editorToggleHex()
 {
-	va_list ap;
-	va_start(ap, fmt);
-	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-	va_end(ap);
-	E.statusmsg_time = time(NULL);
-	E.duration = duration;
+	if (E.hex_view) {
+		if (E.hex_pending) {
+			struct stat st;
+			if (stat(E.filename, &st) == -1) {
+				editorSetStatusMessage(5, "can't read %s: %s", E.filename, strerror(errno));
+				return;
+			}
+			editorLoadMappedRows(editorIndexLoad(E.filename, &st));
+			if (E.map_size >= INDEX_MIN_SIZE) editorIndexStore(&st);
+			E.hex_pending = 0;
+		}
+		E.hex_view = 0;
+
+		int lo = 0, hi = E.line_count - 1;
+		if (!E.dirty && E.line_count > 0) {
+			while (lo < hi)
+			{
+				int mid = lo + (hi - lo + 1) / 2;
+				if (editorRowOffset(mid) <= E.hex_cursor) lo = mid;
+				else hi = mid - 1;
+			}
+			editorRowChars(&E.text[lo]);
+			E.cy = lo;
+			E.cx = E.hex_cursor - E.text[lo].offset;
+			if (E.cx > E.text[lo].size) E.cx = E.text[lo].size;
+		}
+	} else {
+		if (E.map == NULL || E.client) {
+			editorSetStatusMessage(5, "only files read from disk can be shown in hex");
+			return;
+		}
+		E.hex_view = 1;
+		if (E.cy < E.line_count && editorRowOffset(E.cy) != -1) {
+			editorRowChars(&E.text[E.cy]);
+			E.hex_cursor = E.text[E.cy].offset + (E.cx < E.text[E.cy].disk_size ? E.cx : 0);
+		}
+		if (E.hex_cursor >= (off_t)E.map_size) E.hex_cursor = E.map_size - 1;
+		if (E.dirty) editorSetStatusMessage(5, "the hex view shows the file on disk, without the changes");
+	}
+	E.full_redraw = 1;
 }
 
-void editorClearStatusMessage()
+// the hex view only moves around, the file is never changed from it
+void editorHexKey(int c)
 {
-	E.statusmsg[0] = '\0';
+	off_t page = (off_t)(E.screenrows > 1 ? E.screenrows - 1 : 1) * HEX_WIDTH;
+	off_t last = E.map_size ? (off_t)E.map_size - 1 : 0;
+
+	switch (c)
+	{
+		case ARROW_LEFT: E.hex_cursor--; break;
+		case ARROW_RIGHT: E.hex_cursor++; break;
+		case ARROW_UP: E.hex_cursor -= HEX_WIDTH; break;
+		case ARROW_DOWN: E.hex_cursor += HEX_WIDTH; break;
+		case PAGE_UP: E.hex_cursor -= page; break;
+		case PAGE_DOWN: E.hex_cursor += page; break;
+		case CTRL_KEY('f'): editorHexFind(); break;
+		case CTRL_KEY('g'): editorHexGoto(); break;
+		case UNHANDLED_KEY: break;
+		default:
+			editorSetStatusMessage(3, "the hex view is read only, Ctrl+X goes back to the text");
+	}
+	if (E.hex_cursor < 0) E.hex_cursor = 0;
+	if (E.hex_cursor > last) E.hex_cursor = last;
 }
 
 void editorMoveCursor(int key)
@@ -611,12 +5169,12 @@ void editorMoveCursor(int key)
 			break;
 		case ARROW_UP:
 			if (E.cy != 0) {
-				E.cy--;
+				E.cy = editorFileRow(editorVisibleRow(E.cy) - 1);
 			}
 			break;
 		case ARROW_DOWN:
 			if (E.cy < E.line_count) {
-				E.cy++;
+				E.cy = editorFileRow(editorVisibleRow(E.cy) + 1);
 			}
 			break;
 	}
@@ -628,10 +5186,154 @@ void editorMoveCursor(int key)
 	}
 }
 
+// Keys typed with a block go to all of its cursors at once. Returns 0 for the
+// keys that leave the block, those are then handled as usual.
+int editorBlockKey(int c)
+{
+	int top;
+	int count = editorBlockRows(&top);
+	row *line = E.cy < E.line_count ? &E.text[E.cy] : NULL;
+	int cx;
+
+	switch (c)
+	{
+		case CTRL_KEY('b'):
+			E.block_anchor = -1;
+			break;
+
+		case ARROW_LEFT:
+		case ARROW_RIGHT:
+			editorMoveCursor(c);
+			if (line) E.block_rx = editorRowCxToRx(line, E.cx);
+			break;
+
+		case ARROW_UP:
+		case ARROW_DOWN:
+			editorMoveCursor(c);
+			break;
+
+		case PAGE_UP:
+		case PAGE_DOWN: {
+			int times = E.screenrows;
+			while (times--)
+				editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+			break;
+		}
+
+		case CTRL_KEY('h'):
+		case BACKSPACE:
+			if (E.block_rx == 0) break;
+			// a tab before the cursor is deleted as a whole
+			cx = line ? editorRowRxToCx(line, E.block_rx) : -1;
+			E.block_rx = cx > 0 ? editorRowCxToRx(line, cx - 1) : E.block_rx - 1;
+			editorBlockDelChar(top, count, E.block_rx);
+			break;
+
+		case DEL_KEY:
+			editorBlockDelChar(top, count, E.block_rx);
+			break;
+
+		default:
+			if (c != '\t' && (c < ' ' || c > 255)) {
+				E.block_anchor = -1;
+				E.full_redraw = 1;
+				return 0;
+			}
+			editorBlockInsertChar(top, count, E.block_rx, c);
+			if (c == '\t')
+				E.block_rx += E.tab_stop - E.block_rx % E.tab_stop;
+			else
+				E.block_rx++;
+	}
+
+	// the cursor keeps to the column, or the end of a row that doesn't reach it
+	if (E.cy < E.line_count) {
+		cx = editorRowRxToCx(&E.text[E.cy], E.block_rx);
+		E.cx = cx == -1 ? E.text[E.cy].size : cx;
+	}
+	E.full_redraw = 1;
+	return 1;
+}
+
+void editorToggleRecording()
+{
+	if (E.macro_recording) {
+		// the Ctrl+R that stopped it
+		E.macro_len--;
+		E.macro_recording = 0;
+		editorSetStatusMessage(5, "recorded %d keys, Ctrl+Y replays them", E.macro_len);
+	} else {
+		E.macro_len = 0;
+		E.macro_recording = 1;
+		editorSetStatusMessage(5, "recording keys, Ctrl+R again to stop");
+	}
+}
+
+// Nothing is drawn while the macro is replayed, the keys are handled one after the
+// other without waiting for input, and the screen is drawn once at the end.
+// To the end of the file it's replayed as long as it leaves fewer rows below the
+// cursor each time. A key pressed in the meantime stops it.
+void editorReplayMacro()
+{
+	void editorProcessKeypress();
+
+	if (E.macro_recording) {
+		E.macro_len--;
+		editorSetStatusMessage(5, "a macro can't be replayed while it's recorded");
+		return;
+	}
+	if (E.macro_len == 0) {
+		editorSetStatusMessage(5, "no keys recorded, Ctrl+R starts recording");
+		return;
+	}
+
+	char *answer = editorPrompt("Replay: %s (times, $ for until the end of the file)");
+	if (answer == NULL) return;
+	int to_end = strcmp(answer, "$") == 0;
+	int times = atoi(answer);
+	if (!to_end && times <= 0) {
+		editorSetStatusMessage(5, "not a number of times: %s", answer);
+		free(answer);
+		return;
+	}
+	free(answer);
+
+	long long start = monotonicMillis();
+	int done = 0;
+	while (to_end || done < times)
+	{
+		int buffer = E.current_buffer;
+		int below = E.line_count - E.cy;
+		if (to_end && below <= 0) break;
+
+		E.macro_replaying = 1;
+		E.macro_pos = 0;
+		while (E.macro_replaying && E.macro_pos < E.macro_len)
+			editorProcessKeypress();
+		if (!E.macro_replaying) break;
+		E.macro_replaying = 0;
+		done++;
+
+		if (to_end && (E.current_buffer != buffer || E.line_count - E.cy >= below)) break;
+		if (done % 64 == 0 && editorPollCancel()) break;
+	}
+	E.macro_replaying = 0;
+	E.full_redraw = 1;
+	editorSetStatusMessage(5, "replayed %d times in %lld ms", done, monotonicMillis() - start);
+}
+
 void editorProcessKeypress()
 {
 	int c = editorReadKey();
 
+	if (E.hex_view && c != '\x1b' && c != CTRL_KEY('c') && c != CTRL_KEY('w') && c != CTRL_KEY('x') &&
+		c != CTRL_KEY('o') && c != CTRL_KEY('n') && c != CTRL_KEY('p') &&
+		c != CTRL_KEY('r') && c != CTRL_KEY('y')) {
+		editorHexKey(c);
+		return;
+	}
+	if (E.block_anchor != -1 && editorBlockKey(c)) return;
+
 	switch (c)
 	{
 		case '\r':
@@ -640,11 +5342,13 @@ void editorProcessKeypress()
 
 		case '\x1b':
 		case CTRL_KEY('c'):
-			if (E.dirty) {
+			// attached buffers keep their changes in the daemon
+			if (!E.client && editorUnsavedBuffers()) {
 				editorSetStatusMessage(
 					0,
-					"WARNING: This buffer has unsaved changes. "
-					"Discard changes? (y/N)"
+					"WARNING: %s unsaved changes. "
+					"Discard changes? (y/N)",
+					E.dirty ? "This buffer has" : "Other buffers have"
 				);
 				int reply = editorReadKey();
 				switch (reply)
@@ -659,6 +5363,8 @@ void editorProcessKeypress()
 						return;
 				}
 			}
+			editorForEachBuffer(editorJournalRemove);
+			pthread_mutex_lock(&E.output_lock);
 			write(STDOUT_FILENO, "\x1b[2J", 4);
 			write(STDOUT_FILENO, "\x1b[H", 3);
 			exit(0);
@@ -668,6 +5374,52 @@ void editorProcessKeypress()
 			editorSave();
 			break;
 
+		case CTRL_KEY('x'):
+			editorToggleHex();
+			break;
+
+		case CTRL_KEY('o'):
+			editorOpenBuffer();
+			break;
+
+		case CTRL_KEY('n'):
+			editorSwitchBuffer(E.current_buffer + 1);
+			break;
+
+		case CTRL_KEY('p'):
+			editorSwitchBuffer(E.current_buffer - 1);
+			break;
+
+		case CTRL_KEY('d'):
+			editorToggleDiff();
+			break;
+
+		case CTRL_KEY('e'):
+			editorLineCommand();
+			break;
+
+		case CTRL_KEY('t'):
+			editorComplete();
+			break;
+
+		case CTRL_KEY('f'):
+			editorToggleFold();
+			break;
+
+		case CTRL_KEY('r'):
+			editorToggleRecording();
+			break;
+
+		case CTRL_KEY('y'):
+			editorReplayMacro();
+			break;
+
+		case CTRL_KEY('b'):
+			E.block_anchor = E.cy;
+			E.block_rx = E.cy < E.line_count ? editorRowCxToRx(&E.text[E.cy], E.cx) : 0;
+			E.full_redraw = 1;
+			break;
+
 		case CTRL_KEY('h'):
 		case BACKSPACE:
 		case DEL_KEY:
@@ -682,6 +5434,14 @@ void editorProcessKeypress()
 			editorMoveCursor(c);
 			break;
 
+		case PAGE_UP:
+		case PAGE_DOWN: {
+			int times = E.screenrows;
+			while (times--)
+				editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+			break;
+		}
+
 		// keys to be ignored
 		case CTRL_KEY('l'):
 		case CTRL_KEY('g'):
@@ -706,34 +5466,65 @@ void editorLoadConfig()
 		ini_sget(conf, NULL, "tabstop", "%d", &E.tab_stop);
 		const char *nl = ini_get(conf, NULL, "numberline");
 
-		if (strcmp(nl, "on") == 0)
+		if (nl && strcmp(nl, "on") == 0)
 			E.number_line = 1;
+
+		const char *ps = ini_get(conf, NULL, "partialsave");
+		if (ps && strcmp(ps, "on") == 0)
+			E.partial_save = 1;
+
+		unsigned int limit = 0;
+		if (ini_sget(conf, NULL, "memlimit", "%u", &limit))
+			E.mem_limit = (size_t)limit << 20;
 		ini_free(conf);
 	}
 }
 
-void initEditor()
+void initBuffers()
 {
-	E.cx = 0;
-	E.cy = 0;
-	E.rx = 0;
-
-	E.rowoff = 0;
-	E.coloff = 0;
+	void editorCatchMapFaults();
 
-	E.line_count = 0;
-	E.text = NULL;
-	E.filename = NULL;
-	E.dirty = 0;
+	E.journal_replaying = 0;
+	E.macro_recording = 0;
+	E.macro_replaying = 0;
+	E.diff_running = 0;
+	E.inotify_fd = -1;
 
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
 	E.duration = 0;
 
+	E.map_damaged = 0;
+	E.map_faults = 0;
+	E.loading_map = NULL;
+	E.loading_size = 0;
+	editorCatchMapFaults();
+
+	E.full_redraw = 1;
+	E.damage_lo = INT_MAX;
+	E.damage_hi = -1;
+	E.drawn_bars.b = NULL;
+	E.drawn_bars.len = 0;
+
 	E.tab_stop = DEFAULT_TAB_STOP;
 	E.number_line = 0;
+	E.partial_save = 0;
+	E.mem_limit = 0;
 	editorLoadConfig();
 
+	E.buffers = malloc(sizeof(textBuffer));
+	E.buffer_count = 1;
+	E.current_buffer = 0;
+	E.buffer_clock = 0;
+	E.buffers[0].last_used = 0;
+	editorResetBuffer();
+}
+
+void initEditor()
+{
+	initBuffers();
+	E.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
 	if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("EditorInit: getWindowSize");
 	E.screenrows -= 2;
 	E.textcols = E.screencols;
@@ -745,22 +5536,254 @@ void initEditor()
 
 		E.textcols = E.screencols - E.number_line_width;
 	}
+
+	pthread_mutex_init(&E.lock, NULL);
+	pthread_mutex_init(&E.output_lock, NULL);
+	pthread_cond_init(&E.frame_cond, NULL);
+	E.frame_pending = 0;
+
+	pthread_mutex_lock(&E.lock);
+	if (pthread_create(&E.render_thread, NULL, editorRenderLoop, NULL) != 0)
+		die("EditorInit: pthread_create");
+}
+
+typedef struct
+{
+	int fd;
+	int buffer;
+	buffer in;
+} daemonClient;
+
+int editorDaemonBuffer(const char *path)
+{
+	int j;
+	for (j = 0; j < E.buffer_count; j++)
+	{
+		char *name = j == E.current_buffer ? E.filename : E.buffers[j].filename;
+		if (name && strcmp(name, path) == 0) return j;
+	}
+
+	if (path[0] != '/' || access(path, R_OK) == -1) return -1;
+	editorNewBuffer();
+	editorOpen((char *)path);
+	return E.current_buffer;
+}
+
+// Requests are one line each: "open <path>" (answered with the line count and
+// whether the buffer has unsaved changes), "rows <first> <count>", "save" and
+// "edit <len>" followed by a journal record. Edits get no reply, so typing never
+// waits on the daemon. Returns the bytes consumed, 0 while the request is
+// incomplete and -1 to drop the client.
+int editorDaemonRequest(daemonClient *clients, int count, daemonClient *client,
+	const char *p, int len, buffer *out)
+{
+	const char *nl = memchr(p, '\n', len);
+	if (nl == NULL) return len > PATH_MAX + 16 ? -1 : 0;
+
+	int headlen = nl - p + 1;
+	char *req = strndup(p, headlen - 1);
+	char reply[160];
+	int consumed = headlen;
+	int a, b, j;
+
+	if (client->buffer != -1) {
+		editorSwapBuffer(client->buffer);
+		E.buffers[client->buffer].last_used = ++E.buffer_clock;
+	}
+
+	if (strncmp(req, "open ", 5) == 0 && client->buffer == -1) {
+		int index = editorDaemonBuffer(&req[5]);
+		for (j = 0; j < count && index != -1; j++)
+			if (clients[j].buffer == index) {
+				index = -1;
+				errno = EBUSY;
+			}
+
+		if (index == -1) {
+			a = snprintf(reply, sizeof(reply), "err %d\n", errno);
+		} else {
+			client->buffer = index;
+			a = snprintf(reply, sizeof(reply), "ok %d %d\n", E.line_count, E.dirty);
+		}
+		bufferAppend(out, reply, a);
+	} else if (client->buffer == -1) {
+		consumed = -1;
+	} else if (sscanf(req, "edit %d", &a) == 1) {
+		if (a < 0) {
+			consumed = -1;
+		} else if (len - headlen < a) {
+			consumed = 0;
+		} else {
+			size_t used;
+			editorJournalReplay(&p[headlen], a, &used, 1);
+			consumed += a;
+		}
+	} else if (sscanf(req, "rows %d %d", &a, &b) == 2) {
+		if (a < 0 || a > E.line_count) a = E.line_count;
+		if (b > DAEMON_MAX_ROWS) b = DAEMON_MAX_ROWS;
+		if (b > E.line_count - a) b = E.line_count - a;
+		if (b < 0) b = 0;
+
+		bufferAppend(out, reply, snprintf(reply, sizeof(reply), "rows %d\n", b));
+		for (j = a; j < a + b; j++)
+		{
+			row *line = &E.text[j];
+			char *chars = editorRowChars(line);
+			bufferAppend(out, reply, snprintf(reply, sizeof(reply), "%d\n", line->size));
+			bufferAppend(out, chars, line->size);
+		}
+	} else if (strcmp(req, "save") == 0) {
+		editorSave();
+		a = snprintf(reply, sizeof(reply), "%s %s\n", E.dirty ? "err" : "ok", E.statusmsg);
+		bufferAppend(out, reply, a);
+	} else {
+		consumed = -1;
+	}
+
+	free(req);
+	return consumed;
+}
+
+int editorDaemonServe(daemonClient *clients, int count, daemonClient *client)
+{
+	char chunk[1 << 16];
+	ssize_t n = read(client->fd, chunk, sizeof(chunk));
+	if (n == -1 && errno == EINTR) return 0;
+	if (n <= 0) return -1;
+	bufferAppend(&client->in, chunk, n);
+
+	buffer out = BUFFER_INIT;
+	int pos = 0;
+	int consumed;
+	while ((consumed = editorDaemonRequest(clients, count, client,
+		&client->in.b[pos], client->in.len - pos, &out)) > 0)
+		pos += consumed;
+
+	memmove(client->in.b, &client->in.b[pos], client->in.len - pos);
+	client->in.len -= pos;
+
+	if (out.len > 0 && sendAll(client->fd, out.b, out.len) == -1) consumed = -1;
+	free(out.b);
+	return consumed == -1 ? -1 : 0;
+}
+
+// Keeps buffers open for clients started with --attach. The daemon forks into
+// the background once its socket is bound and serves one client at a time per
+// buffer; edits that were never saved stay in the buffer for the next attach.
+void editorDaemon()
+{
+	initBuffers();
+	E.headless = 1;
+
+	struct sockaddr_un addr;
+	if (editorSocketAddress(&addr) == -1) die("EditorDaemon: editorSocketAddress");
+
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "ctxt: a daemon is already listening on %s\n", addr.sun_path);
+		exit(1);
+	}
+	if (probe != -1) close(probe);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener == -1) die("EditorDaemon: socket");
+	unlink(addr.sun_path);
+	umask(077);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("EditorDaemon: bind");
+	if (listen(listener, 16) == -1) die("EditorDaemon: listen");
+
+	pid_t pid = fork();
+	if (pid == -1) die("EditorDaemon: fork");
+	if (pid > 0) {
+		printf("ctxt: daemon %d listening on %s\n", (int)pid, addr.sun_path);
+		exit(0);
+	}
+
+	setsid();
+	if (chdir("/") == -1) die("EditorDaemon: chdir");
+	int null = open("/dev/null", O_RDWR);
+	if (null != -1) {
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		if (null > STDERR_FILENO) close(null);
+	}
+
+	daemonClient *clients = NULL;
+	struct pollfd *fds = NULL;
+	int count = 0;
+	while (1)
+	{
+		fds = realloc(fds, sizeof(struct pollfd) * (count + 1));
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		int j;
+		for (j = 0; j < count; j++)
+		{
+			fds[j + 1].fd = clients[j].fd;
+			fds[j + 1].events = POLLIN;
+		}
+
+		int ready = poll(fds, count + 1, JOURNAL_SYNC_INTERVAL);
+		if (ready == -1 && errno != EINTR) die("EditorDaemon: poll");
+		if (ready <= 0) {
+			editorForEachBuffer(editorJournalSync);
+			editorEnforceMemoryLimit();
+			continue;
+		}
+
+		int polled = count;
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if (fd != -1 && !socketPeerIsUs(fd)) {
+				close(fd);
+			} else if (fd != -1) {
+				struct timeval timeout = {DAEMON_SEND_TIMEOUT, 0};
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+				clients = realloc(clients, sizeof(daemonClient) * (count + 1));
+				clients[count].fd = fd;
+				clients[count].buffer = -1;
+				clients[count].in.b = NULL;
+				clients[count].in.len = 0;
+				count++;
+			}
+		}
+
+		for (j = polled - 1; j >= 0; j--)
+		{
+			if (!(fds[j + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			if (editorDaemonServe(clients, count, &clients[j]) == -1) {
+				close(clients[j].fd);
+				free(clients[j].in.b);
+				clients[j] = clients[--count];
+			}
+		}
+		editorForEachBuffer(editorJournalSync);
+	}
 }
 
 int main(int argc, char *argv[])
 {
+	if (argc >= 2 && strcmp(argv[1], "--daemon") == 0) editorDaemon();
+
 	enableRawMode();
 	initEditor();
-	if (argc >= 2) {
+	if (argc >= 3 && strcmp(argv[1], "--attach") == 0) {
+		E.client = 1;
+		if (editorAttach(argv[2]) == -1) die("EditorAttach");
+	} else if (argc >= 2) {
 		editorOpen(argv[1]);
 	}
 
-	editorSetStatusMessage(5, "press ESC to quit | ^W (CTRL+W) to save");
+	// what recovering the journal had to say goes first
+	if (E.statusmsg[0] == '\0')
+		editorSetStatusMessage(5, "press ESC to quit | ^W save | ^O open | ^N/^P switch buffer");
 
 	while (1)
 	{
-		editorRefreshScreen();
 		editorProcessKeypress();
+		editorPrefetchRows();
 	}
 
 	return 0;